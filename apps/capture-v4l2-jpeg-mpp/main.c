@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -27,6 +28,7 @@
 #include "log.h"
 
 const char NAL_AUD_FRAME[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xf0};
+const char NAL_AUD_FRAME_HEVC[] = {0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50};
 
 int debug = 0;
 static volatile sig_atomic_t running = 1;
@@ -37,8 +39,9 @@ static void signal_handler(int sig)
     running = 0;
 }
 
-static void write_output_rename_cb(const void *data, size_t size, void *arg)
+static void write_output_rename_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
 {
+    (void)meta;
     const char *output = arg;
     char tmp_path[512];
     snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", output);
@@ -54,6 +57,118 @@ static void write_output_rename_cb(const void *data, size_t size, void *arg)
     }
 }
 
+static void h264_sock_write_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
+{
+    struct iovec iov[] = {
+        { (void *)data, size },
+        { (void *)NAL_AUD_FRAME, sizeof(NAL_AUD_FRAME) },
+    };
+    sock_write_iov(arg, iov, 2, meta);
+}
+
+static void h265_sock_write_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
+{
+    struct iovec iov[] = {
+        { (void *)data, size },
+        { (void *)NAL_AUD_FRAME_HEVC, sizeof(NAL_AUD_FRAME_HEVC) },
+    };
+    sock_write_iov(arg, iov, 2, meta);
+}
+
+// Serves both H264 and H265 sockets, told apart by the socket codec.
+static void video_output_cb(MppPacket packet, void *opaque, void *arg)
+{
+    MppFrame decoded = opaque;
+    sock_ctx_t *sock = arg;
+
+    if (packet) {
+        frame_meta_t meta = { .timestamp_us = mpp_frame_get_pts(decoded) };
+        if (mpp_packet_is_intra(packet)) {
+            meta.flags = SOCK_FRAME_KEYFRAME | SOCK_FRAME_PARAM_SETS;
+        }
+        if (sock->codec == SOCK_CODEC_H265) {
+            h265_sock_write_cb(mpp_packet_get_pos(packet), mpp_packet_get_length(packet), &meta, sock);
+        } else {
+            h264_sock_write_cb(mpp_packet_get_pos(packet), mpp_packet_get_length(packet), &meta, sock);
+        }
+    }
+
+    mpp_frame_deinit(&decoded);
+}
+
+static void dmabuf_release_cb(void *opaque, void *arg)
+{
+    (void)arg;
+    mpp_buffer_put((MppBuffer)opaque);
+}
+
+// The decoded buffer stays referenced until every DMA-buf client released it.
+static void dmabuf_write_frame(sock_ctx_t *sock, MppFrame frame, uint64_t timestamp_us)
+{
+    MppBuffer buffer = mpp_frame_get_buffer(frame);
+    unsigned int hor_stride = mpp_frame_get_hor_stride(frame);
+    unsigned int ver_stride = mpp_frame_get_ver_stride(frame);
+    sock_dmabuf_desc_t desc = {
+        .fourcc = V4L2_PIX_FMT_NV12,
+        .width = mpp_frame_get_width(frame),
+        .height = mpp_frame_get_height(frame),
+        .stride = hor_stride,
+        .vstride = ver_stride,
+        .size = hor_stride * ver_stride * 3 / 2,
+        .timestamp_us = timestamp_us,
+    };
+
+    mpp_buffer_inc_ref(buffer);
+    sock_write_dmabuf(sock, mpp_buffer_get_fd(buffer), &desc, buffer);
+}
+
+typedef struct {
+    v4l2_capture_t *v4l2;
+    mpp_dec_ctx_t *dec;
+    sock_ctx_t *video_sock;
+    sock_ctx_t *dmabuf_sock;
+} decode_input_t;
+
+// Runs on the encoder thread, or inline when there is no video output:
+// decodes the held V4L2 frame, returns it to the driver, hands the decoded
+// buffer to DMA-buf clients and encodes it, video_output_cb() frees it.
+static void decode_input_cb(mpp_enc_ctx_t *enc, const mpp_enc_input_t *input, void *arg)
+{
+    decode_input_t *in = arg;
+    unsigned int index = (unsigned int)(uintptr_t)input->opaque;
+    uint64_t timestamp_us = v4l2_timestamp_us(&in->v4l2->buffers[index].buf);
+
+    MppFrame decoded = mpp_decode_jpeg(in->dec, input->data, input->size);
+    v4l2_capture_unref_frame(in->v4l2, index);
+    if (!decoded) {
+        return;
+    }
+
+    mpp_frame_set_pts(decoded, timestamp_us);
+
+    if (in->dmabuf_sock->num_clients > 0) {
+        dmabuf_write_frame(in->dmabuf_sock, decoded, timestamp_us);
+    }
+
+    if (in->video_sock->num_clients == 0) {
+        mpp_frame_deinit(&decoded);
+        return;
+    }
+
+    if (enc->async) {
+        if (mpp_encode_mppframe_async(enc, decoded, input->force_idr, decoded) < 0) {
+            mpp_frame_deinit(&decoded);
+        }
+        return;
+    }
+
+    MppPacket packet = mpp_encode_mppframe(enc, decoded, input->force_idr);
+    mpp_encoder_deliver(enc, packet, decoded);
+    if (packet) {
+        mpp_packet_deinit(&packet);
+    }
+}
+
 static void print_usage(const char *prog)
 {
     printf("Usage: %s [options]\n", prog);
@@ -65,9 +180,12 @@ static void print_usage(const char *prog)
     printf("  --jpeg-sock <path>      JPEG snapshot socket path, write once and close (optional)\n");
     printf("  --mjpeg-sock <path>     MJPEG stream output socket path (optional)\n");
     printf("  --h264-sock <path>      H264 stream output socket path (optional)\n");
-    printf("  --h264-bitrate <kbps>   H264 bitrate in kbps (default: 2000)\n");
+    printf("  --h264-bitrate <kbps>   H264/H265 bitrate in kbps (default: 2000)\n");
+    printf("  --h265-sock <path>      H265 stream output socket path, instead of --h264-sock (optional)\n");
+    printf("  --dmabuf-sock <path>    Decoded NV12 frame DMA-buf fd passing socket path (optional)\n");
     printf("  --fps <fps>             Frames per second (default: 30)\n");
     printf("  --num-planes <n>        Number of capture planes (default: 1)\n");
+    printf("  --encode-depth <n>      Frames in flight in the video encoder, 0 encodes synchronously (default: 0)\n");
     printf("  --idle <ms>             Idle sleep in ms when no readers (default: 1000)\n");
     printf("  --debug                 Enable debug output\n");
     printf("  --help                  Show this help\n");
@@ -82,11 +200,14 @@ int main(int argc, char *argv[])
     const char *jpeg_snapshot = NULL;
     const char *mjpeg_stream = NULL;
     const char *h264_stream = NULL;
+    const char *h265_stream = NULL;
+    const char *dmabuf_stream = NULL;
     int width = 1920;
     int height = 1080;
     int bitrate = 2000;
     int fps = 30;
     int num_planes = 1;
+    int encode_depth = 0;
     int idle_ms = 1000;
     int opt;
 
@@ -98,9 +219,12 @@ int main(int argc, char *argv[])
         OPT_SNAPSHOT,
         OPT_MJPEG,
         OPT_H264,
+        OPT_H265,
         OPT_BITRATE,
+        OPT_DMABUF,
         OPT_FPS,
         OPT_NUM_PLANES,
+        OPT_ENCODE_DEPTH,
         OPT_IDLE,
         OPT_DEBUG,
         OPT_HELP,
@@ -115,8 +239,11 @@ int main(int argc, char *argv[])
         {"mjpeg-sock",    required_argument, 0, OPT_MJPEG},
         {"h264-sock",     required_argument, 0, OPT_H264},
         {"h264-bitrate",  required_argument, 0, OPT_BITRATE},
+        {"h265-sock",     required_argument, 0, OPT_H265},
+        {"dmabuf-sock",   required_argument, 0, OPT_DMABUF},
         {"fps",           required_argument, 0, OPT_FPS},
         {"num-planes",    required_argument, 0, OPT_NUM_PLANES},
+        {"encode-depth",  required_argument, 0, OPT_ENCODE_DEPTH},
         {"idle",          required_argument, 0, OPT_IDLE},
         {"debug",         no_argument,       0, OPT_DEBUG},
         {"help",          no_argument,       0, OPT_HELP},
@@ -146,6 +273,12 @@ int main(int argc, char *argv[])
         case OPT_H264:
             h264_stream = optarg;
             break;
+        case OPT_H265:
+            h265_stream = optarg;
+            break;
+        case OPT_DMABUF:
+            dmabuf_stream = optarg;
+            break;
         case OPT_BITRATE:
             bitrate = atoi(optarg);
             break;
@@ -155,6 +288,9 @@ int main(int argc, char *argv[])
         case OPT_NUM_PLANES:
             num_planes = atoi(optarg);
             break;
+        case OPT_ENCODE_DEPTH:
+            encode_depth = atoi(optarg);
+            break;
         case OPT_IDLE:
             idle_ms = atoi(optarg);
             break;
@@ -170,12 +306,22 @@ int main(int argc, char *argv[])
         }
     }
 
+    // The decoded frames feed a single encoder.
+    if (h264_stream && h265_stream) {
+        log_errorf("--h264-sock and --h265-sock cannot be used together\n");
+        return 1;
+    }
+
     v4l2_capture_t v4l2 = DEFAULT_V4L2_CAPTURE;
     mpp_dec_ctx_t mpp_dec = {0};
     mpp_enc_ctx_t mpp_enc = {0};
     sock_ctx_t jpeg_sock = DEFAULT_SOCK_CTX;
     sock_ctx_t mjpeg_sock = DEFAULT_SOCK_CTX;
     sock_ctx_t h264_sock = DEFAULT_SOCK_CTX;
+    sock_ctx_t h265_sock = DEFAULT_SOCK_CTX;
+    sock_ctx_t dmabuf_sock = DEFAULT_SOCK_CTX;
+    sock_ctx_t *video_sock = h265_stream ? &h265_sock : &h264_sock;
+    decode_input_t decode_input = { &v4l2, &mpp_dec, video_sock, &dmabuf_sock };
 
     log_printf("Device: %s\n", device);
     log_printf("Resolution: %dx%d\n", width, height);
@@ -183,6 +329,8 @@ int main(int argc, char *argv[])
     if (jpeg_snapshot) log_printf("JPEG snapshot socket: %s\n", jpeg_snapshot);
     if (mjpeg_stream) log_printf("MJPEG stream socket: %s\n", mjpeg_stream);
     if (h264_stream) log_printf("H264 stream socket: %s\n", h264_stream);
+    if (h265_stream) log_printf("H265 stream socket: %s\n", h265_stream);
+    if (dmabuf_stream) log_printf("DMA-buf socket: %s\n", dmabuf_stream);
     log_printf("FPS: %d\n", fps);
 
     signal(SIGINT, signal_handler);
@@ -198,19 +346,32 @@ int main(int argc, char *argv[])
         goto error;
     }
     jpeg_sock.one_frame = true;
+    jpeg_sock.codec = SOCK_CODEC_JPEG;
 
     if (mjpeg_stream && sock_open(&mjpeg_sock, mjpeg_stream) < 0) {
         log_errorf( "Failed to open MJPEG socket\n");
         goto error;
     }
     mjpeg_sock.allow_drops = true;
+    mjpeg_sock.codec = SOCK_CODEC_JPEG;
 
-    if (h264_stream) {
-        if (mpp_jpeg_decoder_init(&mpp_dec, v4l2.width, v4l2.height, MPP_FMT_YUV420SP) < 0) {
-            log_errorf( "Failed to initialize JPEG decoder\n");
+    if ((h264_stream || h265_stream || dmabuf_stream) &&
+        mpp_jpeg_decoder_init(&mpp_dec, v4l2.width, v4l2.height, MPP_FMT_YUV420SP) < 0) {
+        log_errorf( "Failed to initialize JPEG decoder\n");
+        goto error;
+    }
+
+    if (dmabuf_stream) {
+        if (sock_open(&dmabuf_sock, dmabuf_stream) < 0) {
+            log_errorf( "Failed to open DMA-buf socket\n");
             goto error;
         }
+        dmabuf_sock.allow_drops = true;
+        dmabuf_sock.codec = SOCK_CODEC_DMABUF;
+        dmabuf_sock.release_cb = dmabuf_release_cb;
+    }
 
+    if (h264_stream) {
         if (mpp_h264_encoder_init(&mpp_enc, v4l2.width, v4l2.height, MPP_FMT_YUV420SP, bitrate, fps) < 0) {
             log_errorf( "Failed to initialize H264 encoder\n");
             goto error;
@@ -220,6 +381,39 @@ int main(int argc, char *argv[])
             log_errorf( "Failed to open H264 socket\n");
             goto error;
         }
+        h264_sock.codec = SOCK_CODEC_H264;
+        h264_sock.gop_cache = true;
+    }
+
+    if (h265_stream) {
+        if (mpp_h265_encoder_init(&mpp_enc, v4l2.width, v4l2.height, MPP_FMT_YUV420SP, bitrate, fps) < 0) {
+            log_errorf( "Failed to initialize H265 encoder\n");
+            goto error;
+        }
+
+        if (sock_open(&h265_sock, h265_stream) < 0) {
+            log_errorf( "Failed to open H265 socket\n");
+            goto error;
+        }
+        h265_sock.codec = SOCK_CODEC_H265;
+        h265_sock.gop_cache = true;
+    }
+
+    if (h264_stream || h265_stream) {
+        mpp_encoder_set_output(&mpp_enc, video_output_cb, video_sock);
+
+        if (encode_depth > 0) {
+            log_printf("Encode depth: %d\n", encode_depth);
+            if (mpp_encoder_start_async(&mpp_enc, encode_depth) < 0) {
+                log_errorf( "Failed to start async encoder\n");
+                goto error;
+            }
+        }
+
+        if (mpp_encoder_start_worker(&mpp_enc, decode_input_cb, &decode_input) < 0) {
+            log_errorf( "Failed to start encoder thread\n");
+            goto error;
+        }
     }
 
     if (v4l2_capture_start(&v4l2) < 0) {
@@ -236,7 +430,7 @@ int main(int argc, char *argv[])
     clock_gettime(CLOCK_MONOTONIC, &last_frame);
     int frames_this_second = 0;
     int frames_this_jpeg_captured = 0;
-    int frames_this_h264_captured = 0;
+    int frames_this_video_captured = 0;
 
     while (running) {
         int r = v4l2_capture_wait_for_frame(&v4l2, 2000);
@@ -259,9 +453,13 @@ int main(int argc, char *argv[])
         void *frame_data = v4l2.buffers[buf.index].start[0];
         size_t bytesused = buf.bytesused;
 
+        v4l2_capture_hold_frame(&v4l2, &buf);
+
         sock_accept_clients(&jpeg_sock);
         sock_accept_clients(&mjpeg_sock);
         sock_accept_clients(&h264_sock);
+        sock_accept_clients(&h265_sock);
+        sock_accept_clients(&dmabuf_sock);
 
         callback_chain_t jpeg_chain[] = {
             { write_output_rename_cb, (void*)jpeg_output, jpeg_output != NULL },
@@ -276,44 +474,64 @@ int main(int argc, char *argv[])
         int encoded_any = 0;
 
         if (callback_chain_active(jpeg_chain)) {
-            callback_chain_write_cb(frame_data, bytesused, (void *)jpeg_chain);
+            frame_meta_t meta = { .timestamp_us = v4l2_timestamp_us(&buf), .flags = SOCK_FRAME_KEYFRAME };
+            callback_chain_write_cb(frame_data, bytesused, &meta, (void *)jpeg_chain);
             frames_this_jpeg_captured++;
             encoded_any = 1;
         }
 
-        if (h264_sock.num_clients > 0) {
-            MppFrame decoded = mpp_decode_jpeg(&mpp_dec, frame_data, bytesused);
-            if (decoded) {
-                MppPacket packet = mpp_encode_mppframe(&mpp_enc, decoded, h264_sock.need_keyframe);
-                if (packet) {
-                    sock_write_cb(mpp_packet_get_pos(packet), mpp_packet_get_length(packet), &h264_sock);
-                    sock_write_cb(NAL_AUD_FRAME, sizeof(NAL_AUD_FRAME), &h264_sock);
-                    mpp_packet_deinit(&packet);
+        if (video_sock->num_clients > 0 || dmabuf_sock.num_clients > 0) {
+            if (video_sock->num_clients > 0) {
+                mpp_encoder_set_bitrate(&mpp_enc, video_sock->bitrate_kbps);
+            }
+
+            // Taken in one step: the socket writer thread may set it again
+            // at any time.
+            bool force_idr = atomic_exchange(&video_sock->need_keyframe, false);
+            mpp_enc_input_t input = {
+                .fd = -1,
+                .data = frame_data,
+                .size = bytesused,
+                .force_idr = force_idr,
+                .opaque = (void *)(uintptr_t)buf.index,
+            };
+
+            v4l2_capture_ref_frame(&v4l2, buf.index);
+            if (!mpp_enc.worker) {
+                decode_input_cb(&mpp_enc, &input, &decode_input);
+            } else if (mpp_encoder_queue(&mpp_enc, &input) < 0) {
+                v4l2_capture_unref_frame(&v4l2, buf.index);
+                if (force_idr) {
+                    atomic_store(&video_sock->need_keyframe, true);
                 }
-                h264_sock.need_keyframe = false;
-                frames_this_h264_captured++;
-                encoded_any = 1;
-                mpp_frame_deinit(&decoded);
             }
+            if (video_sock->num_clients > 0) {
+                frames_this_video_captured++;
+            }
+            encoded_any = 1;
         }
 
-        v4l2_capture_release_frame(&v4l2, &buf);
+        v4l2_capture_unref_frame(&v4l2, buf.index);
 
         struct timespec now;
         clock_gettime(CLOCK_MONOTONIC, &now);
         long elapsed_ns = (now.tv_sec - stats_time.tv_sec) * 1000000000L +
                           (now.tv_nsec - stats_time.tv_nsec);
         if (elapsed_ns >= 1000000000L) {
-            log_printf("FPS: %d (JPEG: %d, H264: %d) (total: %d). JPEG: %d, MJPEG: %d, H264: %d\n",
-                   frames_this_second, frames_this_jpeg_captured, frames_this_h264_captured,
+            const char *video = h265_stream ? "H265" : "H264";
+            int video_encoded, video_dropped;
+            mpp_encoder_take_stats(&mpp_enc, &video_encoded, &video_dropped);
+            log_printf("FPS: %d (JPEG: %d, %s: %d) (total: %d). JPEG: %d, MJPEG: %d, %s: %d. Encoded: %s %d (dropped %d)\n",
+                   frames_this_second, frames_this_jpeg_captured, video, frames_this_video_captured,
                    frames_captured,
                    jpeg_sock.num_clients,
                    mjpeg_sock.num_clients,
-                   h264_sock.num_clients
+                   video, video_sock->num_clients,
+                   video, video_encoded, video_dropped
             );
             frames_this_second = 0;
             frames_this_jpeg_captured = 0;
-            frames_this_h264_captured = 0;
+            frames_this_video_captured = 0;
             stats_time = now;
         }
 
@@ -325,13 +543,16 @@ int main(int argc, char *argv[])
         last_frame = now;
 
         if (!encoded_any && idle_ms > 0) {
-            sock_ctx_t *socks[] = { &jpeg_sock, &mjpeg_sock, &h264_sock, NULL };
+            sock_ctx_t *socks[] = { &jpeg_sock, &mjpeg_sock, &h264_sock, &h265_sock, &dmabuf_sock, NULL };
             sock_wait_fds(socks, idle_ms);
         }
     }
 
+    mpp_encoder_stop(&mpp_enc);
+    sock_close(&dmabuf_sock);
     v4l2_capture_stop(&v4l2);
     sock_close(&h264_sock);
+    sock_close(&h265_sock);
     sock_close(&mjpeg_sock);
     sock_close(&jpeg_sock);
     mpp_encoder_close(&mpp_enc);
@@ -343,10 +564,15 @@ int main(int argc, char *argv[])
 
 error_stop:
     log_printf("Captured %d frames, but failed.\n", frames_captured);
+    mpp_encoder_stop(&mpp_enc);
+    sock_close(&dmabuf_sock);
     v4l2_capture_stop(&v4l2);
 
 error:
+    mpp_encoder_stop(&mpp_enc);
+    sock_close(&dmabuf_sock);
     sock_close(&h264_sock);
+    sock_close(&h265_sock);
     sock_close(&mjpeg_sock);
     sock_close(&jpeg_sock);
     mpp_encoder_close(&mpp_enc);
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
 #include <time.h>
 #include <signal.h>
 #include <getopt.h>
@@ -21,11 +22,13 @@
 
 #include "v4l2_capture.h"
 #include "sock_ctx.h"
+#include "shm_ring_ctx.h"
 #include "callback_chain.h"
 #include "mpp_enc_ctx.h"
 #include "log.h"
 
 const char NAL_AUD_FRAME[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xf0};
+const char NAL_AUD_FRAME_HEVC[] = {0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50};
 
 int debug = 0;
 static volatile sig_atomic_t running = 1;
@@ -71,8 +74,9 @@ static unsigned int parse_v4l2_format(const char *fmt)
     return V4L2_PIX_FMT_YUYV;
 }
 
-static void write_output_rename_cb(const void *data, size_t size, void *arg)
+static void write_output_rename_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
 {
+    (void)meta;
     const char *output = arg;
     char tmp_path[512];
     snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", output);
@@ -88,6 +92,81 @@ static void write_output_rename_cb(const void *data, size_t size, void *arg)
     }
 }
 
+static void h264_sock_write_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
+{
+    struct iovec iov[] = {
+        { (void *)data, size },
+        { (void *)NAL_AUD_FRAME, sizeof(NAL_AUD_FRAME) },
+    };
+    sock_write_iov(arg, iov, 2, meta);
+}
+
+static void h265_sock_write_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
+{
+    struct iovec iov[] = {
+        { (void *)data, size },
+        { (void *)NAL_AUD_FRAME_HEVC, sizeof(NAL_AUD_FRAME_HEVC) },
+    };
+    sock_write_iov(arg, iov, 2, meta);
+}
+
+typedef struct {
+    v4l2_capture_t *v4l2;
+    callback_chain_t *chain;
+    uint32_t flags; // SOCK_FRAME_* set on every packet
+} encode_output_t;
+
+static void encode_output_cb(MppPacket packet, void *opaque, void *arg)
+{
+    encode_output_t *out = arg;
+    unsigned int index = (unsigned int)(uintptr_t)opaque;
+
+    if (packet) {
+        frame_meta_t meta = {
+            .timestamp_us = v4l2_timestamp_us(&out->v4l2->buffers[index].buf),
+            .flags = out->flags,
+        };
+        if (mpp_packet_is_intra(packet)) {
+            meta.flags |= SOCK_FRAME_KEYFRAME | SOCK_FRAME_PARAM_SETS;
+        }
+        callback_chain_write_cb(mpp_packet_get_pos(packet), mpp_packet_get_length(packet), &meta, out->chain);
+    }
+
+    v4l2_capture_unref_frame(out->v4l2, index);
+}
+
+static void dmabuf_release_cb(void *opaque, void *arg)
+{
+    v4l2_capture_unref_frame(arg, (unsigned int)(uintptr_t)opaque);
+}
+
+static int queue_v4l2_frame(mpp_enc_ctx_t *enc, v4l2_capture_t *v4l2, unsigned int index, size_t bytesused, int force_idr)
+{
+    v4l2_buffer_t *buffer = &v4l2->buffers[index];
+    mpp_enc_input_t input = {
+        .fd = v4l2->num_planes == 1 ? buffer->dmabuf_fd[0] : -1,
+        .length = buffer->length[0],
+        .data = buffer->start[0],
+        .size = bytesused,
+        .force_idr = force_idr,
+        .opaque = (void *)(uintptr_t)index,
+    };
+
+    // Rather skip a frame than let the encoders starve the driver.
+    if (!v4l2_capture_can_hold(v4l2)) {
+        atomic_fetch_add(&enc->frames_dropped, 1);
+        return -1;
+    }
+
+    v4l2_capture_ref_frame(v4l2, index);
+
+    if (mpp_encoder_queue(enc, &input) < 0) {
+        v4l2_capture_unref_frame(v4l2, index);
+        return -1;
+    }
+    return 0;
+}
+
 static void print_usage(const char *prog)
 {
     printf("Usage: %s [options]\n", prog);
@@ -101,10 +180,15 @@ static void print_usage(const char *prog)
     printf("  --jpeg-sock <path>      JPEG snapshot socket path, write once and close (optional)\n");
     printf("  --mjpeg-sock <path>     MJPEG stream output socket path (optional)\n");
     printf("  --h264-sock <path>      H264 stream output socket path (optional)\n");
-    printf("  --h264-bitrate <kbps>   H264 bitrate in kbps (default: 2000)\n");
+    printf("  --h264-bitrate <kbps>   H264/H265 bitrate in kbps (default: 2000)\n");
+    printf("  --h265-sock <path>      H265 stream output socket path (optional)\n");
     printf("  --raw-frame-sock <path> Raw frame output socket path (optional)\n");
+    printf("  --raw-frame-shm <path>  Raw frame shared memory ring socket path (optional)\n");
+    printf("  --raw-frame-slots <n>   Number of frames in the shared memory ring (default: 4)\n");
+    printf("  --raw-frame-dmabuf <path> Raw frame DMA-buf fd passing socket path (optional)\n");
     printf("  --fps <fps>             Frames per second (default: 30)\n");
     printf("  --num-planes <n>        Number of capture planes (default: 1)\n");
+    printf("  --encode-depth <n>      Frames in flight per encoder, 0 encodes synchronously (default: 0)\n");
     printf("  --idle <ms>             Idle sleep in ms when no readers (default: 1000)\n");
     printf("  --debug                 Enable debug output\n");
     printf("  --help                  Show this help\n");
@@ -120,13 +204,18 @@ int main(int argc, char *argv[])
     const char *jpeg_snapshot = NULL;
     const char *mjpeg_stream = NULL;
     const char *h264_stream = NULL;
+    const char *h265_stream = NULL;
     const char *raw_frame = NULL;
+    const char *raw_frame_shm = NULL;
+    int raw_frame_slots = 4;
+    const char *raw_frame_dmabuf = NULL;
     int width = 1920;
     int height = 1080;
     int quality = 80;
     int bitrate = 2000;
     int fps = 30;
     int num_planes = 1;
+    int encode_depth = 0;
     int idle_ms = 1000;
     int opt;
 
@@ -140,10 +229,15 @@ int main(int argc, char *argv[])
         OPT_JPEG_SOCK,
         OPT_MJPEG_SOCK,
         OPT_H264_SOCK,
+        OPT_H265_SOCK,
         OPT_BITRATE,
         OPT_RAW_FRAME_SOCK,
+        OPT_RAW_FRAME_SHM,
+        OPT_RAW_FRAME_SLOTS,
+        OPT_RAW_FRAME_DMABUF,
         OPT_FPS,
         OPT_NUM_PLANES,
+        OPT_ENCODE_DEPTH,
         OPT_IDLE,
         OPT_DEBUG,
         OPT_HELP,
@@ -160,9 +254,14 @@ int main(int argc, char *argv[])
         {"mjpeg-sock",     required_argument, 0, OPT_MJPEG_SOCK},
         {"h264-sock",      required_argument, 0, OPT_H264_SOCK},
         {"h264-bitrate",   required_argument, 0, OPT_BITRATE},
+        {"h265-sock",      required_argument, 0, OPT_H265_SOCK},
         {"raw-frame-sock", required_argument, 0, OPT_RAW_FRAME_SOCK},
+        {"raw-frame-shm",  required_argument, 0, OPT_RAW_FRAME_SHM},
+        {"raw-frame-slots", required_argument, 0, OPT_RAW_FRAME_SLOTS},
+        {"raw-frame-dmabuf", required_argument, 0, OPT_RAW_FRAME_DMABUF},
         {"fps",            required_argument, 0, OPT_FPS},
         {"num-planes",     required_argument, 0, OPT_NUM_PLANES},
+        {"encode-depth",   required_argument, 0, OPT_ENCODE_DEPTH},
         {"idle",           required_argument, 0, OPT_IDLE},
         {"debug",          no_argument,       0, OPT_DEBUG},
         {"help",           no_argument,       0, OPT_HELP},
@@ -198,18 +297,33 @@ int main(int argc, char *argv[])
         case OPT_H264_SOCK:
             h264_stream = optarg;
             break;
+        case OPT_H265_SOCK:
+            h265_stream = optarg;
+            break;
         case OPT_BITRATE:
             bitrate = atoi(optarg);
             break;
         case OPT_RAW_FRAME_SOCK:
             raw_frame = optarg;
             break;
+        case OPT_RAW_FRAME_SHM:
+            raw_frame_shm = optarg;
+            break;
+        case OPT_RAW_FRAME_SLOTS:
+            raw_frame_slots = atoi(optarg);
+            break;
+        case OPT_RAW_FRAME_DMABUF:
+            raw_frame_dmabuf = optarg;
+            break;
         case OPT_FPS:
             fps = atoi(optarg);
             break;
         case OPT_NUM_PLANES:
             num_planes = atoi(optarg);
             break;
+        case OPT_ENCODE_DEPTH:
+            encode_depth = atoi(optarg);
+            break;
         case OPT_IDLE:
             idle_ms = atoi(optarg);
             break;
@@ -229,10 +343,14 @@ int main(int argc, char *argv[])
     v4l2_capture_t v4l2 = DEFAULT_V4L2_CAPTURE;
     mpp_enc_ctx_t mpp_jpeg = {0};
     mpp_enc_ctx_t mpp_h264 = {0};
+    mpp_enc_ctx_t mpp_h265 = {0};
     sock_ctx_t jpeg_sock = DEFAULT_SOCK_CTX;
     sock_ctx_t mjpeg_sock = DEFAULT_SOCK_CTX;
     sock_ctx_t h264_sock = DEFAULT_SOCK_CTX;
+    sock_ctx_t h265_sock = DEFAULT_SOCK_CTX;
     sock_ctx_t raw_frame_sock = DEFAULT_SOCK_CTX;
+    shm_ring_ctx_t raw_frame_ring = DEFAULT_SHM_RING_CTX;
+    sock_ctx_t dmabuf_sock = DEFAULT_SOCK_CTX;
 
     log_printf("Device: %s\n", device);
     log_printf("Resolution: %dx%d\n", width, height);
@@ -241,18 +359,33 @@ int main(int argc, char *argv[])
     if (jpeg_snapshot) log_printf("JPEG snapshot socket: %s\n", jpeg_snapshot);
     if (mjpeg_stream) log_printf("MJPEG stream socket: %s\n", mjpeg_stream);
     if (h264_stream) log_printf("H264 stream socket: %s\n", h264_stream);
+    if (h265_stream) log_printf("H265 stream socket: %s\n", h265_stream);
     if (raw_frame) log_printf("Raw frame socket: %s\n", raw_frame);
+    if (raw_frame_shm) log_printf("Raw frame ring: %s (%d slots)\n", raw_frame_shm, raw_frame_slots);
+    if (raw_frame_dmabuf) log_printf("Raw frame DMA-buf socket: %s\n", raw_frame_dmabuf);
     log_printf("FPS: %d\n", fps);
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
+    // Async encoders keep up to `encode_depth` more frames each in flight;
+    // only encoders with somewhere to send their output count. Capped;
+    // queue_v4l2_frame() drops frames rather than starve the driver.
+    if (encode_depth > 0) {
+        int num_encoders = (jpeg_output || jpeg_snapshot || mjpeg_stream) + (h264_stream != NULL) + (h265_stream != NULL);
+        int num_buffers = V4L2_BUFFERS + num_encoders * encode_depth;
+        v4l2.num_buffers = num_buffers < V4L2_MAX_BUFFERS ? num_buffers : V4L2_MAX_BUFFERS;
+    }
+
     if (v4l2_capture_open(&v4l2, device, width, height, pixfmt, fps, num_planes) < 0) {
         log_errorf( "Failed to open V4L2 device\n");
         return 1;
     }
 
     MppFrameFormat mpp_fmt = v4l2_to_mpp_format(v4l2.pixfmt);
+    mpp_jpeg.hor_stride = v4l2.bytesperline;
+    mpp_h264.hor_stride = mpp_jpeg.hor_stride;
+    mpp_h265.hor_stride = mpp_jpeg.hor_stride;
 
     if (mpp_jpeg_encoder_init(&mpp_jpeg, v4l2.width, v4l2.height, mpp_fmt, quality) < 0) {
         log_errorf( "Failed to initialize JPEG encoder\n");
@@ -264,12 +397,14 @@ int main(int argc, char *argv[])
         goto error;
     }
     jpeg_sock.one_frame = true;
+    jpeg_sock.codec = SOCK_CODEC_JPEG;
 
     if (mjpeg_stream && sock_open(&mjpeg_sock, mjpeg_stream) < 0) {
         log_errorf( "Failed to open MJPEG socket\n");
         goto error;
     }
     mjpeg_sock.allow_drops = true;
+    mjpeg_sock.codec = SOCK_CODEC_JPEG;
 
     if (h264_stream) {
         if (mpp_h264_encoder_init(&mpp_h264, v4l2.width, v4l2.height, mpp_fmt, bitrate, fps) < 0) {
@@ -280,12 +415,87 @@ int main(int argc, char *argv[])
             log_errorf( "Failed to open H264 socket\n");
             goto error;
         }
+        h264_sock.codec = SOCK_CODEC_H264;
+        h264_sock.gop_cache = true;
+    }
+
+    if (h265_stream) {
+        if (mpp_h265_encoder_init(&mpp_h265, v4l2.width, v4l2.height, mpp_fmt, bitrate, fps) < 0) {
+            log_errorf( "Failed to initialize H265 encoder\n");
+            goto error;
+        }
+        if (sock_open(&h265_sock, h265_stream) < 0) {
+            log_errorf( "Failed to open H265 socket\n");
+            goto error;
+        }
+        h265_sock.codec = SOCK_CODEC_H265;
+        h265_sock.gop_cache = true;
     }
 
     if (raw_frame && sock_open(&raw_frame_sock, raw_frame) < 0) {
         log_errorf( "Failed to open raw socket\n");
         goto error;
     }
+    raw_frame_sock.codec = SOCK_CODEC_RAW;
+
+    if (raw_frame_shm && shm_ring_open(&raw_frame_ring, raw_frame_shm, raw_frame_slots > 0 ? raw_frame_slots : 1, v4l2.buffers[0].length[0]) < 0) {
+        log_errorf( "Failed to open raw frame ring\n");
+        goto error;
+    }
+
+    if (raw_frame_dmabuf) {
+        if (v4l2.num_planes != 1 || v4l2.buffers[0].dmabuf_fd[0] < 0) {
+            log_errorf( "DMA-buf passing needs single plane exported V4L2 buffers\n");
+            goto error;
+        }
+        if (sock_open(&dmabuf_sock, raw_frame_dmabuf) < 0) {
+            log_errorf( "Failed to open DMA-buf socket\n");
+            goto error;
+        }
+        dmabuf_sock.allow_drops = true;
+        dmabuf_sock.codec = SOCK_CODEC_DMABUF;
+        dmabuf_sock.release_cb = dmabuf_release_cb;
+        dmabuf_sock.release_arg = &v4l2;
+    }
+
+    callback_chain_t jpeg_chain[] = {
+        { write_output_rename_cb, (void*)jpeg_output, jpeg_output != NULL },
+        { sock_write_cb, &jpeg_sock, false },
+        { sock_write_cb, &mjpeg_sock, false },
+        { NULL, NULL, 0 }
+    };
+    callback_chain_t h264_chain[] = {
+        { h264_sock_write_cb, &h264_sock, true },
+        { NULL, NULL, 0 }
+    };
+    callback_chain_t h265_chain[] = {
+        { h265_sock_write_cb, &h265_sock, true },
+        { NULL, NULL, 0 }
+    };
+    encode_output_t jpeg_out = { &v4l2, jpeg_chain, SOCK_FRAME_KEYFRAME };
+    encode_output_t h264_out = { &v4l2, h264_chain, 0 };
+    encode_output_t h265_out = { &v4l2, h265_chain, 0 };
+
+    mpp_encoder_set_output(&mpp_jpeg, encode_output_cb, &jpeg_out);
+    mpp_encoder_set_output(&mpp_h264, encode_output_cb, &h264_out);
+    mpp_encoder_set_output(&mpp_h265, encode_output_cb, &h265_out);
+
+    if (encode_depth > 0) {
+        log_printf("Encode depth: %d\n", encode_depth);
+        if (mpp_encoder_start_async(&mpp_jpeg, encode_depth) < 0 ||
+            (h264_stream && mpp_encoder_start_async(&mpp_h264, encode_depth) < 0) ||
+            (h265_stream && mpp_encoder_start_async(&mpp_h265, encode_depth) < 0)) {
+            log_errorf( "Failed to start async encoders\n");
+            goto error;
+        }
+    }
+
+    if (mpp_encoder_start_worker(&mpp_jpeg, NULL, NULL) < 0 ||
+        (h264_stream && mpp_encoder_start_worker(&mpp_h264, NULL, NULL) < 0) ||
+        (h265_stream && mpp_encoder_start_worker(&mpp_h265, NULL, NULL) < 0)) {
+        log_errorf( "Failed to start encoder threads\n");
+        goto error;
+    }
 
     if (v4l2_capture_start(&v4l2) < 0) {
         log_errorf( "Failed to start V4L2 streaming\n");
@@ -302,6 +512,7 @@ int main(int argc, char *argv[])
     int frames_this_second = 0;
     int frames_this_jpeg_captured = 0;
     int frames_this_h264_captured = 0;
+    int frames_this_h265_captured = 0;
 
     while (running) {
         int r = v4l2_capture_wait_for_frame(&v4l2, 2000);
@@ -325,17 +536,18 @@ int main(int argc, char *argv[])
             ? planes[0].bytesused : buf.bytesused;
         void *frame_data = v4l2.buffers[buf.index].start[0];
 
+        v4l2_capture_hold_frame(&v4l2, &buf);
+
         sock_accept_clients(&jpeg_sock);
         sock_accept_clients(&mjpeg_sock);
         sock_accept_clients(&h264_sock);
+        sock_accept_clients(&h265_sock);
         sock_accept_clients(&raw_frame_sock);
+        shm_ring_accept_clients(&raw_frame_ring);
+        sock_accept_clients(&dmabuf_sock);
 
-        callback_chain_t jpeg_chain[] = {
-            { write_output_rename_cb, (void*)jpeg_output, jpeg_output != NULL },
-            { sock_write_cb, &jpeg_sock, jpeg_sock.num_clients > 0 },
-            { sock_write_cb, &mjpeg_sock, mjpeg_sock.num_clients > 0 },
-            { NULL, NULL, 0 }
-        };
+        atomic_store(&jpeg_chain[1].run, jpeg_sock.num_clients > 0);
+        atomic_store(&jpeg_chain[2].run, mjpeg_sock.num_clients > 0);
 
         frames_captured++;
         frames_this_second++;
@@ -343,49 +555,91 @@ int main(int argc, char *argv[])
         int encoded_any = 0;
 
         if (callback_chain_active(jpeg_chain)) {
-            MppPacket packet = mpp_encode_frame(&mpp_jpeg, frame_data, bytesused, 0);
-            if (packet) {
-                callback_chain_write_cb(mpp_packet_get_pos(packet), mpp_packet_get_length(packet), (void *)jpeg_chain);
-                mpp_packet_deinit(&packet);
-            }
+            queue_v4l2_frame(&mpp_jpeg, &v4l2, buf.index, bytesused, 0);
             frames_this_jpeg_captured++;
             encoded_any = 1;
         }
 
         if (h264_sock.num_clients > 0) {
-            MppPacket packet = mpp_encode_frame(&mpp_h264, frame_data, bytesused, h264_sock.need_keyframe);
-            if (packet) {
-                sock_write_cb(mpp_packet_get_pos(packet), mpp_packet_get_length(packet), &h264_sock);
-                sock_write_cb(NAL_AUD_FRAME, sizeof(NAL_AUD_FRAME), &h264_sock);
-                mpp_packet_deinit(&packet);
+            mpp_encoder_set_bitrate(&mpp_h264, h264_sock.bitrate_kbps);
+            bool force_idr = atomic_exchange(&h264_sock.need_keyframe, false);
+            if (queue_v4l2_frame(&mpp_h264, &v4l2, buf.index, bytesused, force_idr) < 0 && force_idr) {
+                atomic_store(&h264_sock.need_keyframe, true);
             }
-            h264_sock.need_keyframe = false;
             frames_this_h264_captured++;
             encoded_any = 1;
         }
 
+        if (h265_sock.num_clients > 0) {
+            mpp_encoder_set_bitrate(&mpp_h265, h265_sock.bitrate_kbps);
+            bool force_idr = atomic_exchange(&h265_sock.need_keyframe, false);
+            if (queue_v4l2_frame(&mpp_h265, &v4l2, buf.index, bytesused, force_idr) < 0 && force_idr) {
+                atomic_store(&h265_sock.need_keyframe, true);
+            }
+            frames_this_h265_captured++;
+            encoded_any = 1;
+        }
+
         if (raw_frame_sock.num_clients > 0) {
-            sock_write_cb(frame_data, bytesused, &raw_frame_sock);
+            frame_meta_t meta = { .timestamp_us = v4l2_timestamp_us(&buf), .flags = SOCK_FRAME_KEYFRAME };
+            sock_write_cb(frame_data, bytesused, &meta, &raw_frame_sock);
+            encoded_any = 1;
+        }
+
+        if (raw_frame_ring.num_clients > 0) {
+            shm_ring_frame_t info = {
+                .timestamp_us = v4l2_timestamp_us(&buf),
+                .fourcc = v4l2.pixfmt,
+                .width = v4l2.width,
+                .height = v4l2.height,
+                .stride = v4l2.bytesperline,
+                .size = bytesused,
+            };
+            shm_ring_write(&raw_frame_ring, frame_data, &info);
+            encoded_any = 1;
+        }
+
+        if (dmabuf_sock.num_clients > 0 && v4l2_capture_can_hold(&v4l2)) {
+            sock_dmabuf_desc_t desc = {
+                .fourcc = v4l2.pixfmt,
+                .width = v4l2.width,
+                .height = v4l2.height,
+                .stride = v4l2.bytesperline,
+                .vstride = v4l2.height,
+                .size = bytesused,
+                .timestamp_us = v4l2_timestamp_us(&buf),
+            };
+            v4l2_capture_ref_frame(&v4l2, buf.index);
+            sock_write_dmabuf(&dmabuf_sock, v4l2.buffers[buf.index].dmabuf_fd[0], &desc, (void *)(uintptr_t)buf.index);
             encoded_any = 1;
         }
 
-        v4l2_capture_release_frame(&v4l2, &buf);
+        v4l2_capture_unref_frame(&v4l2, buf.index);
 
         struct timespec now;
         clock_gettime(CLOCK_MONOTONIC, &now);
         long elapsed_ns = (now.tv_sec - stats_time.tv_sec) * 1000000000L +
                           (now.tv_nsec - stats_time.tv_nsec);
         if (elapsed_ns >= 1000000000L) {
-                log_printf("FPS: %d (JPEG: %d, H264: %d) (total: %d). JPEG: %d, MJPEG: %d, H264: %d\n",
-                frames_this_second, frames_this_jpeg_captured, frames_this_h264_captured,
+            int jpeg_encoded, jpeg_dropped, h264_encoded, h264_dropped, h265_encoded, h265_dropped;
+            mpp_encoder_take_stats(&mpp_jpeg, &jpeg_encoded, &jpeg_dropped);
+            mpp_encoder_take_stats(&mpp_h264, &h264_encoded, &h264_dropped);
+            mpp_encoder_take_stats(&mpp_h265, &h265_encoded, &h265_dropped);
+            log_printf("FPS: %d (JPEG: %d, H264: %d, H265: %d) (total: %d). JPEG: %d, MJPEG: %d, H264: %d, H265: %d. Encoded: JPEG %d (dropped %d), H264 %d (dropped %d), H265 %d (dropped %d)\n",
+                frames_this_second, frames_this_jpeg_captured, frames_this_h264_captured, frames_this_h265_captured,
                 frames_captured,
                 jpeg_sock.num_clients,
                 mjpeg_sock.num_clients,
-                h264_sock.num_clients
+                h264_sock.num_clients,
+                h265_sock.num_clients,
+                jpeg_encoded, jpeg_dropped,
+                h264_encoded, h264_dropped,
+                h265_encoded, h265_dropped
             );
             frames_this_second = 0;
             frames_this_jpeg_captured = 0;
             frames_this_h264_captured = 0;
+            frames_this_h265_captured = 0;
             stats_time = now;
         }
 
@@ -397,17 +651,24 @@ int main(int argc, char *argv[])
         last_frame = now;
 
         if (!encoded_any && idle_ms > 0) {
-            sock_ctx_t *socks[] = { &jpeg_sock, &mjpeg_sock, &h264_sock, &raw_frame_sock, NULL };
+            sock_ctx_t *socks[] = { &jpeg_sock, &mjpeg_sock, &h264_sock, &h265_sock, &raw_frame_sock, &dmabuf_sock, NULL };
             sock_wait_fds(socks, idle_ms);
         }
     }
 
+    mpp_encoder_stop(&mpp_h264);
+    mpp_encoder_stop(&mpp_h265);
+    mpp_encoder_stop(&mpp_jpeg);
+    sock_close(&dmabuf_sock);
     v4l2_capture_stop(&v4l2);
     sock_close(&raw_frame_sock);
+    shm_ring_close(&raw_frame_ring);
     sock_close(&h264_sock);
+    sock_close(&h265_sock);
     sock_close(&mjpeg_sock);
     sock_close(&jpeg_sock);
     mpp_encoder_close(&mpp_h264);
+    mpp_encoder_close(&mpp_h265);
     mpp_encoder_close(&mpp_jpeg);
     v4l2_capture_close(&v4l2);
 
@@ -416,14 +677,25 @@ int main(int argc, char *argv[])
 
 error_stop:
     log_printf("Captured %d frames, but failed.\n", frames_captured);
+    mpp_encoder_stop(&mpp_h264);
+    mpp_encoder_stop(&mpp_h265);
+    mpp_encoder_stop(&mpp_jpeg);
+    sock_close(&dmabuf_sock);
     v4l2_capture_stop(&v4l2);
 
 error:
+    mpp_encoder_stop(&mpp_h264);
+    mpp_encoder_stop(&mpp_h265);
+    mpp_encoder_stop(&mpp_jpeg);
     sock_close(&raw_frame_sock);
+    shm_ring_close(&raw_frame_ring);
+    sock_close(&dmabuf_sock);
     sock_close(&h264_sock);
+    sock_close(&h265_sock);
     sock_close(&mjpeg_sock);
     sock_close(&jpeg_sock);
     mpp_encoder_close(&mpp_h264);
+    mpp_encoder_close(&mpp_h265);
     mpp_encoder_close(&mpp_jpeg);
     v4l2_capture_close(&v4l2);
     return 1;
@@ -1,12 +1,20 @@
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstring>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <getopt.h>
+#include <poll.h>
 #include <signal.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -15,37 +23,163 @@
 #include <liveMedia.hh>
 
 #include "h264_frames.h"
+#include "h264_sps.h"
 #include "h264_stream.h"
 #include "log.h"
 
-using Buffer = std::vector<uint8_t>;
-using BufferPtr = std::shared_ptr<Buffer>;
+// One access unit, copied once out of the socket buffer and shared by all
+// sessions. `nals` holds offset/size of each NAL unit without start code.
+// `cached` frames are the capture app's GOP cache replayed on connect.
+struct Frame {
+    std::vector<uint8_t> data;
+    std::vector<std::pair<size_t, size_t>> nals;
+    struct timeval presentation_time;
+    bool keyframe;
+    bool cached;
+    std::atomic<unsigned> refs{0};
+};
+
+// Shared reference to a pooled Frame. The count lives in the Frame itself,
+// so unlike a shared_ptr handing a frame out allocates nothing.
+class FramePtr {
+public:
+    FramePtr() = default;
+    explicit FramePtr(Frame *frame) : frame(frame) { ref(); }
+    FramePtr(const FramePtr &other) : frame(other.frame) { ref(); }
+    FramePtr(FramePtr &&other) noexcept : frame(std::exchange(other.frame, nullptr)) {}
+    ~FramePtr() { unref(); }
+
+    FramePtr &operator=(FramePtr other) noexcept {
+        std::swap(frame, other.frame);
+        return *this;
+    }
+
+    Frame *operator->() const { return frame; }
+    explicit operator bool() const { return frame != nullptr; }
+
+private:
+    void ref() {
+        if (frame) {
+            frame->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    inline void unref();
+
+    Frame *frame = nullptr;
+};
+
+// Frames go back to the pool when the last session is done with them, so
+// their buffers are reused instead of allocated per frame.
+class FramePool {
+public:
+    FramePtr get() {
+        Frame *frame;
+        {
+            std::unique_lock lk(lock);
+            if (frames.empty()) {
+                frame = new Frame();
+            } else {
+                frame = frames.back().release();
+                frames.pop_back();
+            }
+        }
+        return FramePtr(frame);
+    }
+
+    void put(Frame *frame) {
+        std::unique_lock lk(lock);
+        if (frames.size() >= MAX_FREE) {
+            delete frame;
+            return;
+        }
+        frame->data.clear();
+        frame->nals.clear();
+        frame->keyframe = false;
+        frame->cached = false;
+        frames.emplace_back(frame);
+    }
+
+private:
+    static constexpr size_t MAX_FREE = 16;
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<Frame>> frames;
+};
+
+static FramePool g_frame_pool;
+
+void FramePtr::unref() {
+    if (frame && frame->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        g_frame_pool.put(frame);
+    }
+}
+
+// One input socket served at rtsp://<host>/<name>. The socket is only
+// connected while the mount has sessions.
+struct Mount {
+    std::string name;
+    std::string sock;
+    h264_stream_t stream = H264_STREAM_INIT;
+    std::set<class DynamicH264Stream *> streams;
+    TaskScheduler *scheduler = nullptr;
+
+    // Latest parameter sets and measured bitrate, kept across reconnects so
+    // DESCRIBE is answered from them instead of waiting for the stream.
+    // `params_gen` changes whenever they do.
+    uint8_t codec = SOCK_CODEC_NONE;
+    std::shared_ptr<std::atomic<uint8_t>> probed_codec = std::make_shared<std::atomic<uint8_t>>(SOCK_CODEC_NONE);
+    std::vector<uint8_t> vps, sps, pps;
+    h264_sps_info_t sps_info = {};
+    unsigned params_gen = 0;
+    uint64_t bytes = 0;
+    unsigned bitrate_kbps = 0;
+    struct timespec bitrate_time = {};
+};
 
 static int g_debug = 0;
-static h264_stream_t g_h264_stream = H264_STREAM_INIT;
-static std::set<class DynamicH264Stream *> g_streams;
+static std::vector<std::unique_ptr<Mount>> g_mounts;
+static Mount *g_reading_mount = nullptr;
 static std::recursive_mutex g_streams_lock;
-static std::atomic<int> g_watch_variable{1};
+static volatile char g_watch_variable = 0;
+static EventTriggerId g_frame_trigger = 0;
+static EventTriggerId g_streams_trigger = 0;
+static size_t g_max_clients = 4;
+static size_t g_queue_frames = 8;
+static unsigned g_stream_counter = 0;
 static std::atomic<int> g_dropped_frames{0};
 static std::atomic<int> g_total_frames{0};
+static std::atomic<int64_t> g_latency_us{0};
+
+// Housekeeping runs on this timer; frames and new sessions wake the
+// scheduler through event triggers instead.
+static constexpr int64_t HOUSEKEEPING_INTERVAL_US = 100 * 1000;
+
+// Multicast is meant for displays on the same LAN.
+static constexpr uint8_t MULTICAST_TTL = 1;
 
 class DynamicH264Stream : public FramedSource
 {
 public:
-  DynamicH264Stream(UsageEnvironment& env)
+  DynamicH264Stream(UsageEnvironment& env, Mount *mount, bool multicast = false)
     : FramedSource(env)
+    , id(++g_stream_counter)
+    , mount(mount)
+    , multicast(multicast)
     , isRunning(false)
-    , currentOffset(0)
+    , queuedCached(0)
+    , currentNal(0)
+    , waitKeyframe(true)
+    , dropped(0)
   {
   }
 
   virtual ~DynamicH264Stream()
   {
     std::unique_lock lk(g_streams_lock);
-    g_streams.erase(this);
+    mount->streams.erase(this);
   }
 
-  void sendNewFrame(const BufferPtr &buf)
+  void sendNewFrame(const FramePtr &frame)
   {
     std::unique_lock lk(lock);
 
@@ -53,20 +187,52 @@ public:
       return;
     }
 
-    if (currentBuffer) {
-        log_printf("Dropping frame, previous frame not sent yet\n");
-        g_dropped_frames++;
+    // Frames that reference a dropped one would only decode to garbage, so
+    // after an overflow everything up to the next keyframe is skipped. A
+    // newer keyframe makes the queued frames obsolete. A GOP cache burst
+    // arrives all at once by design and does not count towards the limit.
+    size_t live = queue.size() - queuedCached;
+    if (frame->keyframe) {
+        waitKeyframe = false;
+        if (live >= g_queue_frames) {
+            dropFrames(queue.size());
+            queue.clear();
+            queuedCached = 0;
+        }
+    } else if (waitKeyframe) {
+        dropFrames(1);
         return;
+    } else if (live >= g_queue_frames && !frame->cached) {
+        log_printf("Stream %u: queue full, skipping to the next keyframe\n", id);
+        dropFrames(1);
+        waitKeyframe = true;
+        h264_stream_request_keyframe(&mount->stream);
+        return;
+    }
+
+    queue.push_back(frame);
+    if (frame->cached) {
+        queuedCached++;
     }
+  }
 
-    setNewBuffer(buf);
+  bool isMulticast() const
+  {
+    return multicast;
+  }
+
+  void printStats()
+  {
+    std::unique_lock lk(lock);
+    log_printf("Stream %u (%s): queue %zu/%zu, dropped %llu%s\n", id, mount->name.c_str(), queue.size(), g_queue_frames,
+        (unsigned long long)dropped, waitKeyframe ? ", waiting for keyframe" : "");
   }
 
   void handleClosure()
   {
     {
         std::unique_lock lk(g_streams_lock);
-        g_streams.erase(this);
+        mount->streams.erase(this);
         isRunning.store(false, std::memory_order_release);
     }
     FramedSource::handleClosure();
@@ -77,14 +243,23 @@ public:
     {
         std::unique_lock lk(g_streams_lock);
         if (!isRunning.load(std::memory_order_acquire)) {
-            g_streams.insert(this);
+            mount->streams.insert(this);
             isRunning.store(true, std::memory_order_release);
+            envir().taskScheduler().triggerEvent(g_streams_trigger);
         }
     }
 
     std::unique_lock lk(lock);
 
-    if (!currentBuffer) {
+    if (!currentFrame && !queue.empty()) {
+        setNewFrame(queue.front());
+        queue.pop_front();
+        if (currentFrame->cached && queuedCached > 0) {
+            queuedCached--;
+        }
+    }
+
+    if (!currentFrame) {
         return;
     }
 
@@ -92,19 +267,20 @@ public:
         return;
     }
 
-    size_t remaining = currentBuffer->size() - currentOffset;
-    fFrameSize = std::min<size_t>(fMaxSize, remaining);
-    fNumTruncatedBytes = remaining - fFrameSize;
+    // The discrete framer takes one NAL unit per call.
+    auto [offset, size] = currentFrame->nals[currentNal];
+    fFrameSize = std::min<size_t>(fMaxSize, size);
+    fNumTruncatedBytes = size - fFrameSize;
+    fPresentationTime = currentFrame->presentation_time;
 
-    memcpy(fTo, currentBuffer->data() + currentOffset, fFrameSize);
+    memcpy(fTo, currentFrame->data.data() + offset, fFrameSize);
 
     if (g_debug) {
-        log_printf("Sending frame at offset %u of size %u (truncated %u)\n", currentOffset, fFrameSize, fNumTruncatedBytes);
+        log_printf("Sending NAL %u of size %u (truncated %u)\n", currentNal, fFrameSize, fNumTruncatedBytes);
     }
-    currentOffset += fFrameSize;
 
-    if (currentBuffer->size() == currentOffset) {
-        setNewBuffer(BufferPtr());
+    if (++currentNal == currentFrame->nals.size()) {
+        setNewFrame(FramePtr());
     }
 
     lk.unlock();
@@ -117,117 +293,536 @@ private:
     {
         std::unique_lock lk(g_streams_lock);
         if (isRunning.load(std::memory_order_acquire)) {
-            g_streams.erase(this);
+            mount->streams.erase(this);
             isRunning.store(false, std::memory_order_release);
         }
     }
 
     std::unique_lock lk(lock);
-    setNewBuffer(BufferPtr());
+    setNewFrame(FramePtr());
+    queue.clear();
+    queuedCached = 0;
+    waitKeyframe = true;
   }
 
-  void setNewBuffer(const BufferPtr &buf)
+  void dropFrames(size_t count)
   {
-    currentBuffer = buf;
-    currentOffset = 0;
+    dropped += count;
+    g_dropped_frames += count;
   }
 
+  void setNewFrame(const FramePtr &frame)
+  {
+    currentFrame = frame;
+    currentNal = 0;
+  }
+
+  unsigned id;
+  Mount *mount;
+  bool multicast;
   std::atomic<bool> isRunning;
   std::mutex lock;
-  BufferPtr currentBuffer;
-  unsigned currentOffset;
+  std::deque<FramePtr> queue;
+  size_t queuedCached;
+  FramePtr currentFrame;
+  unsigned currentNal;
+  bool waitKeyframe;
+  uint64_t dropped;
 };
 
 class H264LiveServerMediaSubsession : public OnDemandServerMediaSubsession {
 public:
-    static H264LiveServerMediaSubsession* createNew(UsageEnvironment& env, Boolean reuseFirstSource) {
-        return new H264LiveServerMediaSubsession(env, reuseFirstSource);
+    static H264LiveServerMediaSubsession* createNew(UsageEnvironment& env, Mount *mount, Boolean reuseFirstSource) {
+        return new H264LiveServerMediaSubsession(env, mount, reuseFirstSource);
     }
 
 protected:
-    H264LiveServerMediaSubsession(UsageEnvironment& env, Boolean reuseFirstSource)
-        : OnDemandServerMediaSubsession(env, reuseFirstSource) {}
+    H264LiveServerMediaSubsession(UsageEnvironment& env, Mount *mount, Boolean reuseFirstSource)
+        : OnDemandServerMediaSubsession(env, reuseFirstSource)
+        , mount(mount)
+        , sdpParamsGen(0) {}
 
     virtual ~H264LiveServerMediaSubsession() {}
 
+    // The base class builds the SDP once; rebuild it when the cached
+    // parameter sets changed since.
+    virtual char const* sdpLines(int addressFamily) {
+        if (fSDPLines && sdpParamsGen != mount->params_gen) {
+            delete[] fSDPLines;
+            fSDPLines = nullptr;
+        }
+        sdpParamsGen = mount->params_gen;
+        return OnDemandServerMediaSubsession::sdpLines(addressFamily);
+    }
+
+    // The codec comes from the running stream, the last one seen or the
+    // startup probe, in that order; this runs in the event loop, so it never
+    // waits for the socket. The sink for a source always follows its framer.
+    // Frames arrive already split, so the discrete framers only pass NAL
+    // units on.
     virtual FramedSource* createNewStreamSource(unsigned clientSessionId, unsigned& estBitrate) {
         (void)clientSessionId;
-        estBitrate = 2000;
-        auto framedSource = new DynamicH264Stream(envir());
-        return H264VideoStreamFramer::createNew(envir(), framedSource);
+        estBitrate = mount->bitrate_kbps ? mount->bitrate_kbps : 2000;
+        uint8_t codec = mount->codec;
+        if (mount->stream.fd >= 0 && mount->stream.codec != SOCK_CODEC_NONE) {
+            codec = mount->stream.codec;
+        }
+        if (codec == SOCK_CODEC_NONE) {
+            codec = *mount->probed_codec;
+        }
+        if (codec == SOCK_CODEC_NONE) {
+            log_errorf("/%s: codec not known yet, assuming H264\n", mount->name.c_str());
+        }
+        auto framedSource = new DynamicH264Stream(envir(), mount);
+        if (codec == SOCK_CODEC_H265) {
+            return H265VideoStreamDiscreteFramer::createNew(envir(), framedSource);
+        }
+        return H264VideoStreamDiscreteFramer::createNew(envir(), framedSource);
     }
 
+    // Sinks get the cached parameter sets for sprop-parameter-sets.
     virtual RTPSink* createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic, FramedSource* inputSource) {
-        (void)inputSource;
+        bool hevc = dynamic_cast<H265VideoStreamDiscreteFramer*>(inputSource) != nullptr;
+        bool cached = (hevc ? SOCK_CODEC_H265 : SOCK_CODEC_H264) == mount->codec &&
+            !mount->sps.empty() && !mount->pps.empty() && (!hevc || !mount->vps.empty());
+
+        if (hevc && cached) {
+            return H265VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+                mount->vps.data(), mount->vps.size(), mount->sps.data(), mount->sps.size(),
+                mount->pps.data(), mount->pps.size());
+        }
+        if (hevc) {
+            return H265VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic);
+        }
+        if (cached) {
+            return H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+                mount->sps.data(), mount->sps.size(), mount->pps.data(), mount->pps.size());
+        }
         return H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic);
     }
+
+    // The source is shared, so a joining session would otherwise wait for
+    // the next IDR of the running stream.
+    virtual void startStream(unsigned clientSessionId, void* streamToken, TaskFunc* rtcpRRHandler,
+                             void* rtcpRRHandlerClientData, unsigned short& rtpSeqNum, unsigned& rtpTimestamp,
+                             ServerRequestAlternativeByteHandler* serverRequestAlternativeByteHandler,
+                             void* serverRequestAlternativeByteHandlerClientData) {
+        OnDemandServerMediaSubsession::startStream(clientSessionId, streamToken, rtcpRRHandler,
+            rtcpRRHandlerClientData, rtpSeqNum, rtpTimestamp,
+            serverRequestAlternativeByteHandler, serverRequestAlternativeByteHandlerClientData);
+        h264_stream_request_keyframe(&mount->stream);
+    }
+
+private:
+    Mount *mount;
+    unsigned sdpParamsGen;
+};
+
+// The multicast stream is packetized once by a single RTP sink and sent to
+// the group whether or not anyone listens; RTSP clients only get its SDP.
+class MulticastServerMediaSubsession : public PassiveServerMediaSubsession {
+public:
+    static MulticastServerMediaSubsession* createNew(Mount *mount, RTPSink& rtpSink, RTCPInstance* rtcpInstance) {
+        return new MulticastServerMediaSubsession(mount, rtpSink, rtcpInstance);
+    }
+
+protected:
+    MulticastServerMediaSubsession(Mount *mount, RTPSink& rtpSink, RTCPInstance* rtcpInstance)
+        : PassiveServerMediaSubsession(rtpSink, rtcpInstance)
+        , mount(mount) {}
+
+    // Viewers join a running stream; an IDR lets them start decoding.
+    virtual void startStream(unsigned clientSessionId, void* streamToken, TaskFunc* rtcpRRHandler,
+                             void* rtcpRRHandlerClientData, unsigned short& rtpSeqNum, unsigned& rtpTimestamp,
+                             ServerRequestAlternativeByteHandler* serverRequestAlternativeByteHandler,
+                             void* serverRequestAlternativeByteHandlerClientData) {
+        PassiveServerMediaSubsession::startStream(clientSessionId, streamToken, rtcpRRHandler,
+            rtcpRRHandlerClientData, rtpSeqNum, rtpTimestamp,
+            serverRequestAlternativeByteHandler, serverRequestAlternativeByteHandlerClientData);
+        h264_stream_request_keyframe(&mount->stream);
+    }
+
+private:
+    Mount *mount;
 };
 
+// The framer and sink depend on the codec, which is only known once the
+// startup probe or the stream itself told; until then only the group
+// sockets exist. `codec` is what the running sink was built for.
+typedef struct {
+    UsageEnvironment *env;
+    RTSPServer *server;
+    Mount *mount;
+    Groupsock *rtp_groupsock;
+    Groupsock *rtcp_groupsock;
+    FramedSource *source;
+    RTPSink *sink;
+    RTCPInstance *rtcp;
+    ServerMediaSession *sms;
+    uint8_t codec;
+    std::string group;
+    int port;
+    bool ssm;
+} multicast_t;
+
+static multicast_t g_multicast;
+
+// Multicasts the given mount as <name>-multicast. Sending starts with
+// multicast_update().
+static bool multicast_open(multicast_t *mc, UsageEnvironment *env, RTSPServer *server, Mount *mount, const char *group, int port) {
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+    addr4->sin_family = AF_INET;
+    if (inet_pton(AF_INET, group, &addr4->sin_addr) != 1 || !IN_MULTICAST(ntohl(addr4->sin_addr.s_addr))) {
+        log_errorf("Invalid multicast group: %s\n", group);
+        return false;
+    }
+
+    mc->env = env;
+    mc->server = server;
+    mc->mount = mount;
+    mc->group = group;
+    mc->port = port;
+    // Only 232.0.0.0/8 needs a source-specific join; elsewhere the SDP must
+    // not advertise a source filter.
+    mc->ssm = (ntohl(addr4->sin_addr.s_addr) >> 24) == 232;
+    mc->rtp_groupsock = new Groupsock(*env, addr, Port(port), MULTICAST_TTL);
+    mc->rtcp_groupsock = new Groupsock(*env, addr, Port(port + 1), MULTICAST_TTL);
+    mc->rtp_groupsock->multicastSendOnly();
+    mc->rtcp_groupsock->multicastSendOnly();
+    return true;
+}
+
+// Tears down the session and the sink, leaving the group sockets.
+static void multicast_stop(multicast_t *mc) {
+    if (mc->sms) {
+        mc->server->deleteServerMediaSession(mc->sms);
+    }
+    if (mc->sink) {
+        mc->sink->stopPlaying();
+    }
+    Medium::close(mc->rtcp);
+    Medium::close(mc->sink);
+    Medium::close(mc->source);
+    mc->sms = nullptr;
+    mc->rtcp = nullptr;
+    mc->sink = nullptr;
+    mc->source = nullptr;
+    mc->codec = SOCK_CODEC_NONE;
+}
+
+static void multicast_start(multicast_t *mc, uint8_t codec) {
+    UsageEnvironment *env = mc->env;
+    Mount *mount = mc->mount;
+
+    auto source = new DynamicH264Stream(*env, mount, true);
+    if (codec == SOCK_CODEC_H265) {
+        mc->source = H265VideoStreamDiscreteFramer::createNew(*env, source);
+        mc->sink = H265VideoRTPSink::createNew(*env, mc->rtp_groupsock, 96);
+    } else {
+        mc->source = H264VideoStreamDiscreteFramer::createNew(*env, source);
+        mc->sink = H264VideoRTPSink::createNew(*env, mc->rtp_groupsock, 96);
+    }
+    mc->codec = codec;
+
+    char cname[256] = {0};
+    gethostname(cname, sizeof(cname) - 1);
+    mc->rtcp = RTCPInstance::createNew(*env, mc->rtcp_groupsock, 2000, (unsigned char *)cname, mc->sink, nullptr);
+
+    std::string name = mount->name + "-multicast";
+    mc->sms = ServerMediaSession::createNew(*env, name.c_str(), "Live Stream", "H264/H265 multicast video stream", mc->ssm);
+    mc->sms->addSubsession(MulticastServerMediaSubsession::createNew(mount, *mc->sink, mc->rtcp));
+    mc->server->addServerMediaSession(mc->sms);
+
+    mc->sink->startPlaying(*mc->source, nullptr, nullptr);
+    log_printf("Multicast /%s (%s) to %s:%d\n", name.c_str(), codec == SOCK_CODEC_H265 ? "H265" : "H264",
+        mc->group.c_str(), mc->port);
+}
+
+// Starts sending once the codec is known and rebuilds the framer and sink
+// when the capture app switched codecs. Runs from housekeeping, never from
+// within the sink's own callbacks.
+static void multicast_update(multicast_t *mc) {
+    if (!mc->mount) {
+        return;
+    }
+
+    Mount *mount = mc->mount;
+    uint8_t codec = mount->codec;
+    if (codec == SOCK_CODEC_NONE) {
+        codec = *mount->probed_codec;
+    }
+    if (codec == SOCK_CODEC_NONE || codec == mc->codec) {
+        return;
+    }
+
+    if (mc->codec != SOCK_CODEC_NONE) {
+        log_printf("/%s: codec changed, restarting multicast\n", mount->name.c_str());
+        multicast_stop(mc);
+    }
+    multicast_start(mc, codec);
+}
+
+static void multicast_close(multicast_t *mc) {
+    multicast_stop(mc);
+    delete mc->rtp_groupsock;
+    delete mc->rtcp_groupsock;
+    mc->rtp_groupsock = nullptr;
+    mc->rtcp_groupsock = nullptr;
+    mc->mount = nullptr;
+}
+
+static void mount_cache_param_set(Mount *mount, std::vector<uint8_t> &cache, const uint8_t *data, size_t size, bool is_sps) {
+    if (cache.size() == size && memcmp(cache.data(), data, size) == 0) {
+        return;
+    }
+
+    cache.assign(data, data + size);
+    mount->params_gen++;
+
+    if (!is_sps) {
+        return;
+    }
+
+    bool hevc = mount->codec == SOCK_CODEC_H265;
+    h264_sps_info_t info = {};
+    if (hevc ? h265_parse_sps(data, size, &info) : h264_parse_sps(data, size, &info)) {
+        mount->sps_info = info;
+        log_printf("/%s: %s profile %d level %d, %dx%d\n", mount->name.c_str(), hevc ? "H265" : "H264",
+            info.profile, info.level, info.width, info.height);
+    }
+}
+
+// Keeps the latest VPS/SPS/PPS of the mount, from NAL units without start
+// code.
+static void mount_update_params(Mount *mount, const uint8_t *nal, size_t size) {
+    if (mount->stream.codec != mount->codec) {
+        mount->codec = mount->stream.codec;
+        mount->vps.clear();
+        mount->sps.clear();
+        mount->pps.clear();
+        mount->sps_info = {};
+        mount->params_gen++;
+    }
+
+    if (mount->codec == SOCK_CODEC_H265) {
+        uint8_t nal_type = (nal[0] >> 1) & 0x3f;
+        if (nal_type == 32) {
+            mount_cache_param_set(mount, mount->vps, nal, size, false);
+        } else if (nal_type == 33) {
+            mount_cache_param_set(mount, mount->sps, nal, size, true);
+        } else if (nal_type == 34) {
+            mount_cache_param_set(mount, mount->pps, nal, size, false);
+        }
+    } else {
+        uint8_t nal_type = nal[0] & 0x1f;
+        if (nal_type == 7) {
+            mount_cache_param_set(mount, mount->sps, nal, size, true);
+        } else if (nal_type == 8) {
+            mount_cache_param_set(mount, mount->pps, nal, size, false);
+        }
+    }
+}
+
+// Averages the bitrate over about a second, for estBitrate and b=AS.
+static void mount_update_bitrate(Mount *mount, const struct timespec *now) {
+    long elapsed_ms = (now->tv_sec - mount->bitrate_time.tv_sec) * 1000L +
+                      (now->tv_nsec - mount->bitrate_time.tv_nsec) / 1000000L;
+    if (elapsed_ms < 1000) {
+        return;
+    }
+
+    if (mount->bytes > 0 && elapsed_ms < 2000) {
+        mount->bitrate_kbps = mount->bytes * 8 / elapsed_ms;
+    }
+    mount->bytes = 0;
+    mount->bitrate_time = *now;
+}
+
+// h264_stream_process() has no context argument; the read handler sets
+// g_reading_mount for the duration of the call.
 static void store_frame(const uint8_t *data, size_t size) {
     std::unique_lock lk(g_streams_lock);
+    Mount *mount = g_reading_mount;
+
+    mount->bytes += size;
+
+    if (mount->streams.empty()) {
+        return;
+    }
 
-    if (g_streams.empty()) {
+    FramePtr frame = g_frame_pool.get();
+    frame->data.assign(data, data + size);
+    frame->presentation_time = h264_stream_pts_timeval(&mount->stream);
+    frame->cached = mount->stream.flags & SOCK_FRAME_CACHED;
+    if (!frame->cached) {
+        g_latency_us = h264_stream_now_us() - h264_stream_capture_time_us(&mount->stream);
+    }
+
+    // AUDs only matter in Annex-B; RTP marks frame ends itself.
+    bool hevc = mount->stream.codec == SOCK_CODEC_H265;
+    const uint8_t *base = frame->data.data();
+    const uint8_t *nal = h264_find_nal(base, size);
+    while (nal) {
+        const uint8_t *next = h264_find_nal(nal + 4, base + size - nal - 4);
+        const uint8_t *end = next ? next : base + size;
+        bool aud = hevc ? h265_is_aud_frame(nal, end - nal) : h264_is_aud_frame(nal, end - nal);
+        if (!aud) {
+            frame->nals.emplace_back(nal + 4 - base, end - nal - 4);
+            mount_update_params(mount, nal + 4, end - nal - 4);
+        }
+        if (hevc) {
+            uint8_t nal_type = h265_nal_type(nal);
+            frame->keyframe |= nal_type >= 16 && nal_type <= 21;
+        } else {
+            frame->keyframe |= (nal[4] & 0x1f) == 5;
+        }
+        nal = next;
+    }
+
+    if (frame->nals.empty()) {
         return;
     }
 
     g_total_frames++;
 
-    BufferPtr buf = std::make_shared<Buffer>(data, data + size);
-    for (auto *stream : g_streams) {
-        stream->sendNewFrame(buf);
+    for (auto *stream : mount->streams) {
+        stream->sendNewFrame(frame);
     }
 }
 
-static void h264_read_handler(void*, int) {
-    h264_stream_process(&g_h264_stream, store_frame);
+static void h264_read_handler(void* clientData, int) {
+    Mount *mount = static_cast<Mount*>(clientData);
+    int fd = mount->stream.fd;
+
+    g_reading_mount = mount;
+    ssize_t consumed = h264_stream_process(&mount->stream, store_frame);
+    g_reading_mount = nullptr;
+
+    // h264_stream_process() closes the socket itself on EOF or errors; stop
+    // selecting on it before the next loop and let the mount reconnect.
+    if (mount->stream.fd < 0) {
+        mount->scheduler->disableBackgroundHandling(fd);
+        mount->scheduler->triggerEvent(g_streams_trigger);
+    }
+
+    if (consumed > 0) {
+        mount->scheduler->triggerEvent(g_frame_trigger);
+    }
 }
 
-static void h264_stream_open_or_close(BasicTaskScheduler0* scheduler, const char *h264_sock) {
+static void h264_stream_open_or_close(Mount *mount) {
     std::unique_lock lk(g_streams_lock);
 
-    if (g_streams.size() > 0) {
-        if (h264_stream_open(&g_h264_stream, h264_sock)) {
-            scheduler->setBackgroundHandling(g_h264_stream.fd, SOCKET_READABLE, h264_read_handler, nullptr);
+    if (mount->streams.size() > 0) {
+        if (h264_stream_open(&mount->stream, mount->sock.c_str())) {
+            mount->scheduler->setBackgroundHandling(mount->stream.fd, SOCKET_READABLE, h264_read_handler, mount);
             if (g_debug) {
-                log_errorf("H264 socket opened for streaming\n");
+                log_errorf("H264 socket opened for streaming /%s\n", mount->name.c_str());
             }
         }
-    } else if (g_h264_stream.fd >= 0) {
-        scheduler->disableBackgroundHandling(g_h264_stream.fd);
-        h264_stream_close(&g_h264_stream);
+    } else if (mount->stream.fd >= 0) {
+        mount->scheduler->disableBackgroundHandling(mount->stream.fd);
+        h264_stream_close(&mount->stream);
     }
 }
 
-static void rtsp_flush() {
+static void rtsp_flush(void*) {
     std::unique_lock lk(g_streams_lock);
 
-    for (auto *stream : g_streams) {
-        stream->doGetNextFrame();
+    for (auto &mount : g_mounts) {
+        for (auto *stream : mount->streams) {
+            stream->doGetNextFrame();
+        }
     }
 }
 
-static void close_old_clients(size_t max_clients) {
+// The multicast stream does not count as a client.
+static void close_old_clients(Mount *mount, size_t max_clients) {
     std::unique_lock lk(g_streams_lock);
 
-    while (g_streams.size() > max_clients) {
-        DynamicH264Stream* stream = *g_streams.begin();
+    while (true) {
+        DynamicH264Stream* oldest = nullptr;
+        size_t clients = 0;
+        for (auto *stream : mount->streams) {
+            if (!stream->isMulticast()) {
+                oldest = oldest ? oldest : stream;
+                clients++;
+            }
+        }
+        if (clients <= max_clients) {
+            break;
+        }
+
         lk.unlock();
-        stream->handleClosure();
+        oldest->handleClosure();
         lk.lock();
-        log_errorf("Closed old client, current clients: %zu\n", g_streams.size());
+        log_errorf("Closed old client of /%s, current clients: %zu\n", mount->name.c_str(), clients - 1);
+    }
+}
+
+static void streams_changed(void*) {
+    for (auto &mount : g_mounts) {
+        h264_stream_open_or_close(mount.get());
+        close_old_clients(mount.get(), g_max_clients);
+    }
+}
+
+static void housekeeping(void* clientData) {
+    TaskScheduler* scheduler = static_cast<TaskScheduler*>(clientData);
+    static struct timespec stats_time;
+
+    streams_changed(nullptr);
+    multicast_update(&g_multicast);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (auto &mount : g_mounts) {
+        mount_update_bitrate(mount.get(), &now);
     }
+
+    if (g_debug) {
+        long elapsed_ns = (now.tv_sec - stats_time.tv_sec) * 1000000000L +
+                        (now.tv_nsec - stats_time.tv_nsec);
+        if (elapsed_ns >= 1000000000L) {
+            std::unique_lock lk(g_streams_lock);
+            size_t streams = 0;
+            for (auto &mount : g_mounts) {
+                streams += mount->streams.size();
+            }
+            log_printf("Streams: %zu. Frames: %d. Dropped: %d. Capture latency: %.1f ms\n",
+                streams,
+                g_total_frames.load(),
+                g_dropped_frames.load(),
+                g_latency_us.load() / 1000.0
+            );
+            for (auto &mount : g_mounts) {
+                for (auto *stream : mount->streams) {
+                    stream->printStats();
+                }
+            }
+            stats_time = now;
+        }
+    }
+
+    scheduler->scheduleDelayedTask(HOUSEKEEPING_INTERVAL_US, housekeeping, scheduler);
 }
 
 static void signal_handler(int) {
-    g_watch_variable = 0;
+    g_watch_variable = 1;
 }
 
 static void print_usage(const char* prog) {
     printf("Usage: %s [options]\n", prog);
     printf("Options:\n");
-    printf("  --h264-sock <path>     H264 stream input socket\n");
+    printf("  --h264-sock [name=]<path>  H264 or H265 stream input socket served at /name (default name: stream);\n");
+    printf("                         repeat for more cameras or substreams\n");
     printf("  --rtsp-port <port>     RTSP server port (default: 8554)\n");
     printf("  --max-clients <n>      Max concurrent clients (default: 4)\n");
+    printf("  --queue-frames <n>     Frames queued per session before skipping to a keyframe (default: 8)\n");
+    printf("  --multicast <group>    Also send the first mount to this multicast group, served as /<name>-multicast (optional)\n");
+    printf("  --multicast-port <n>   Multicast RTP port, RTCP uses the next one (default: 18888)\n");
     printf("  --debug                Enable debug output\n");
     printf("  --help                 Show this help\n");
 }
@@ -235,16 +830,20 @@ static void print_usage(const char* prog) {
 int main(int argc, char* argv[]) {
     log_printf("stream-rtsp - built %s (%s)\n", __DATE__, __FILE__);
 
-    std::string h264_sock;
+    std::vector<std::pair<std::string, std::string>> h264_socks;
     int rtsp_port = 8554;
-    int max_clients = 4;
     int buffer_size = 300000;
+    const char *multicast_group = nullptr;
+    int multicast_port = 18888;
 
     enum {
         OPT_H264_SOCK = 1,
         OPT_RTSP_PORT,
         OPT_MAX_CLIENTS,
+        OPT_QUEUE_FRAMES,
         OPT_BUFFER_SIZE,
+        OPT_MULTICAST,
+        OPT_MULTICAST_PORT,
         OPT_DEBUG,
         OPT_HELP,
     };
@@ -253,7 +852,10 @@ int main(int argc, char* argv[]) {
         {"h264-sock",    required_argument, 0, OPT_H264_SOCK},
         {"rtsp-port",    required_argument, 0, OPT_RTSP_PORT},
         {"max-clients",  required_argument, 0, OPT_MAX_CLIENTS},
+        {"queue-frames", required_argument, 0, OPT_QUEUE_FRAMES},
         {"buffer-size",  required_argument, 0, OPT_BUFFER_SIZE},
+        {"multicast",    required_argument, 0, OPT_MULTICAST},
+        {"multicast-port", required_argument, 0, OPT_MULTICAST_PORT},
         {"debug",        no_argument,       0, OPT_DEBUG},
         {"help",         no_argument,       0, OPT_HELP},
         {0, 0, 0, 0}
@@ -262,18 +864,33 @@ int main(int argc, char* argv[]) {
     int opt;
     while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
         switch (opt) {
-        case OPT_H264_SOCK:
-            h264_sock = optarg;
+        case OPT_H264_SOCK: {
+            const char *eq = strchr(optarg, '=');
+            if (eq) {
+                h264_socks.emplace_back(std::string(optarg, eq - optarg), eq + 1);
+            } else {
+                h264_socks.emplace_back("stream", optarg);
+            }
             break;
+        }
         case OPT_RTSP_PORT:
             rtsp_port = std::atoi(optarg);
             break;
         case OPT_MAX_CLIENTS:
-            max_clients = std::atoi(optarg);
+            g_max_clients = std::atoi(optarg);
+            break;
+        case OPT_QUEUE_FRAMES:
+            g_queue_frames = std::max(1, std::atoi(optarg));
             break;
         case OPT_BUFFER_SIZE:
             buffer_size = std::atoi(optarg);
             break;
+        case OPT_MULTICAST:
+            multicast_group = optarg;
+            break;
+        case OPT_MULTICAST_PORT:
+            multicast_port = std::atoi(optarg);
+            break;
         case OPT_DEBUG:
             g_debug = 1;
             break;
@@ -286,19 +903,30 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (h264_sock.empty()) {
+    if (h264_socks.empty()) {
         log_errorf("Error: --h264-sock is required\n");
         print_usage(argv[0]);
         return 1;
     }
 
+    for (size_t i = 0; i < h264_socks.size(); i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (h264_socks[i].first == h264_socks[j].first) {
+                log_errorf("Error: mount /%s given twice\n", h264_socks[i].first.c_str());
+                return 1;
+            }
+        }
+    }
+
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
-    log_printf("H264 socket: %s\n", h264_sock.c_str());
+    for (auto &[name, path] : h264_socks) {
+        log_printf("H264 socket: /%s <- %s\n", name.c_str(), path.c_str());
+    }
     log_printf("RTSP port: %d\n", rtsp_port);
-    log_printf("Max clients: %d\n", max_clients);
+    log_printf("Max clients: %zu\n", g_max_clients);
 
     BasicTaskScheduler0* scheduler = BasicTaskScheduler::createNew();
     UsageEnvironment* env = BasicUsageEnvironment::createNew(*scheduler);
@@ -314,45 +942,43 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    ServerMediaSession* sms = ServerMediaSession::createNew(*env, "stream", "H264 Live Stream", "H264 video stream");
-    sms->addSubsession(H264LiveServerMediaSubsession::createNew(*env, True));
-    rtspServer->addServerMediaSession(sms);
-
     log_printf("RTSP server started\n");
-    log_printf("Access the stream at the following URL:\n");
-    log_printf("  rtsp://<IP_ADDRESS>:%d/stream\n", rtsp_port);
-
-    char* url = rtspServer->rtspURL(sms);
-    log_printf("RTSP URL: %s\n", url);
-    delete[] url;
-
-    struct timespec stats_time;
-    clock_gettime(CLOCK_MONOTONIC, &stats_time);
-
-    while (g_watch_variable) {
-        scheduler->SingleStep(0);
-        h264_stream_open_or_close(scheduler, h264_sock.c_str());
-        close_old_clients(max_clients);
-        rtsp_flush();
-
-        if (g_debug) {
-            struct timespec now;
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            long elapsed_ns = (now.tv_sec - stats_time.tv_sec) * 1000000000L +
-                            (now.tv_nsec - stats_time.tv_nsec);
-            if (elapsed_ns >= 1000000000L) {
-                log_printf("Streams: %zu. Frames: %d. Dropped: %d\n",
-                    g_streams.size(),
-                    g_total_frames.load(),
-                    g_dropped_frames.load()
-                );
-                stats_time = now;
-            }
-        }
+    log_printf("Access the streams at the following URLs:\n");
+
+    for (auto &[name, path] : h264_socks) {
+        auto mount = std::make_unique<Mount>();
+        mount->name = name;
+        mount->sock = path;
+        mount->scheduler = scheduler;
+        h264_stream_probe_codec_async(mount->sock, mount->probed_codec);
+
+        ServerMediaSession* sms = ServerMediaSession::createNew(*env, name.c_str(), "Live Stream", "H264/H265 video stream");
+        sms->addSubsession(H264LiveServerMediaSubsession::createNew(*env, mount.get(), True));
+        rtspServer->addServerMediaSession(sms);
+
+        char* url = rtspServer->rtspURL(sms);
+        log_printf("  %s\n", url);
+        delete[] url;
+
+        g_mounts.push_back(std::move(mount));
     }
 
-    h264_stream_close(&g_h264_stream);
+    if (multicast_group && !multicast_open(&g_multicast, env, rtspServer, g_mounts[0].get(), multicast_group, multicast_port)) {
+        return 1;
+    }
+
+    g_frame_trigger = scheduler->createEventTrigger(rtsp_flush);
+    g_streams_trigger = scheduler->createEventTrigger(streams_changed);
+    housekeeping(scheduler);
+
+    // Sleeps in select() until a socket, trigger or timer needs attention.
+    scheduler->doEventLoop(&g_watch_variable);
+
+    multicast_close(&g_multicast);
     Medium::close(rtspServer);
+    for (auto &mount : g_mounts) {
+        h264_stream_close(&mount->stream);
+    }
     env->reclaim();
     delete scheduler;
 
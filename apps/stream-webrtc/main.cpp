@@ -3,8 +3,9 @@
 #include <mutex>
 #include <atomic>
 #include <memory>
-#include <list>
+#include <functional>
 #include <vector>
+#include <algorithm>
 #include <cstring>
 #include <chrono>
 #include <getopt.h>
@@ -15,25 +16,38 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 
 #include <rtc/rtc.hpp>
 #include <nlohmann/json.hpp>
 
 #include "h264_frames.h"
+#include "h264_rtp.h"
 #include "h264_stream.h"
 #include "log.h"
 
 using json = nlohmann::json;
 
 static std::atomic<bool> g_running{true};
+static std::atomic<bool> g_keyframe_request{false};
+static std::atomic<int64_t> g_latency_us{0};
 static int g_debug = 0;
 static h264_stream_t g_h264_stream = H264_STREAM_INIT;
+static h264_rtp_frame_t g_rtp_frame;
+// Last codec seen on the H264 socket, or found by the startup probe.
+static auto g_stream_codec = std::make_shared<std::atomic<uint8_t>>(SOCK_CODEC_NONE);
+static int g_wake_fd = -1;
 
 static constexpr int PING_INTERVAL_MS = 1000;
 static constexpr int CONNECT_TIMEOUT_MS = 30000;
 static constexpr int PONG_TIMEOUT_MS = 30000;
 static constexpr int DEFAULT_SESSION_S = 60 * 60;
 static constexpr int MAX_SESSION_WITHOUT_TIMEOUT_S = 15 * 60;
+static constexpr int SIGNALING_TIMEOUT_MS = 5000;
+static constexpr int BITRATE_INTERVAL_MS = 1000;
+static constexpr int BITRATE_HEADROOM_PCT = 85;
+static constexpr uint8_t PAYLOAD_TYPE = 96;
+static constexpr int FALL_BEHIND_LOSS = 64; // of 256 in a receiver report, 25%
 
 struct Client {
     std::string id;
@@ -43,33 +57,110 @@ struct Client {
     std::shared_ptr<rtc::RtpPacketizationConfig> rtp_config;
     std::shared_ptr<rtc::RtcpSrReporter> sr_reporter;
     std::chrono::steady_clock::time_point start_time;
+    uint64_t first_pts_us = 0;
     std::chrono::steady_clock::time_point last_ping;
-    std::chrono::steady_clock::time_point last_pong;
+    std::atomic<std::chrono::steady_clock::time_point> last_pong;
     std::vector<std::string> pending_candidates;
     bool answer_received = false;
     bool keepAlive = false;
     int timeout_s = 0;
+    std::atomic<uint32_t> remb_kbps{0};
+    std::atomic<uint8_t> fraction_lost{0};
+    std::atomic<uint32_t> reports{0};
+    uint32_t reports_seen = 0;
+    bool wait_keyframe = false;
+    uint64_t frames_sent = 0;
+    uint64_t frames_dropped = 0;
+    int64_t latency_us = 0;
 };
 
+// The media loop and signaling read an immutable snapshot of the clients,
+// swapped atomically, and never wait for a lock. Adding or removing a client
+// copies the list under g_clients_mutex and publishes the copy; clients are
+// few and change rarely. Per-client media state (wait_keyframe, counters,
+// rtp_config) is only touched by the main loop.
+using ClientList = std::vector<std::shared_ptr<Client>>;
+
 static std::mutex g_clients_mutex;
-static std::list<std::shared_ptr<Client>> g_clients;
+static std::shared_ptr<const ClientList> g_clients = std::make_shared<const ClientList>();
 static std::atomic<uint64_t> g_client_counter{0};
 static std::string g_h264_sock;
 static std::vector<std::string> g_ice_servers;
 static int g_max_clients = 4;
+static uint32_t g_bitrate_kbps = 0;
+static std::chrono::steady_clock::time_point g_bitrate_time;
 
-static std::shared_ptr<Client> find_client(const std::string& id) {
+// Hold on to the returned pointer while using the list: ranging over
+// *clients_snapshot() would release the snapshot before the loop body.
+static std::shared_ptr<const ClientList> clients_snapshot() {
+    return std::atomic_load(&g_clients);
+}
+
+// Replaces the published list with `update` applied to a copy of it.
+template <typename F>
+static void update_clients(F update) {
     std::lock_guard<std::mutex> lock(g_clients_mutex);
-    for (auto& c : g_clients) {
+    auto clients = std::make_shared<ClientList>(*g_clients);
+    update(*clients);
+    std::atomic_store(&g_clients, std::shared_ptr<const ClientList>(std::move(clients)));
+}
+
+static std::shared_ptr<Client> find_client(const std::string& id) {
+    auto clients = clients_snapshot();
+    for (auto& c : *clients) {
         if (c->id == id) return c;
     }
     return nullptr;
 }
 
-static bool has_clients() {
-    std::lock_guard<std::mutex> lock(g_clients_mutex);
+// Hands on the loss the viewer reports for our SSRC in each RTCP SR/RR.
+class ReceiverReportHandler : public rtc::MediaHandler {
+public:
+    ReceiverReportHandler(uint32_t ssrc, std::function<void(uint8_t)> onReport)
+        : ssrc(ssrc), onReport(std::move(onReport)) {}
+
+    void incoming(rtc::message_vector &messages, const rtc::message_callback &) override {
+        for (const auto &message : messages) {
+            if (message->type != rtc::Message::Control) {
+                continue;
+            }
+            int fraction = h264_rtcp_fraction_lost(reinterpret_cast<const uint8_t *>(message->data()), message->size(), ssrc);
+            if (fraction >= 0) {
+                onReport(fraction);
+            }
+        }
+    }
 
-    for (auto& client : g_clients) {
+private:
+    uint32_t ssrc;
+    std::function<void(uint8_t)> onReport;
+};
+
+// Called from the signaling and libdatachannel threads when the main loop
+// should look at the clients again without waiting for its poll timeout.
+static void wake_main_loop() {
+    uint64_t one = 1;
+    if (write(g_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_perror("eventfd write");
+    }
+}
+
+// A viewer that cannot keep up loses frames up to the next keyframe, which
+// is requested right away, and resumes there. Tracks send straight to the
+// SRTP transport and never report bufferedAmount(), so falling behind is
+// seen as send() failing or as heavy loss in the viewer's receiver reports.
+static void fall_behind(Client& client) {
+    if (!client.wait_keyframe) {
+        log_printf("Client %s: falling behind, skipping to the next keyframe\n", client.id.c_str());
+    }
+    client.wait_keyframe = true;
+    client.frames_dropped++;
+    g_keyframe_request = true;
+}
+
+static bool has_clients() {
+    auto clients = clients_snapshot();
+    for (auto& client : *clients) {
         if (client->video_track && client->video_track->isOpen()) {
             return true;
         }
@@ -78,35 +169,149 @@ static bool has_clients() {
     return false;
 }
 
+// RTP timestamps follow the capture time of each frame, so buffering on the
+// way here does not show up as jitter in playback; only a GOP cache burst is
+// retimed to catch up (h264_stream_update_pts()). The frame is packetized
+// once for all clients; each client only gets its own sequence number,
+// timestamp and SSRC written into the shared packets before they are sent.
 static void send_frame(const uint8_t *data, size_t size) {
-    std::lock_guard<std::mutex> lock(g_clients_mutex);
-    auto now = std::chrono::steady_clock::now();
+    uint64_t capture_us = h264_stream_capture_time_us(&g_h264_stream);
+    uint64_t pts_us = h264_stream_pts_us(&g_h264_stream);
+    bool cached = g_h264_stream.flags & SOCK_FRAME_CACHED;
 
-    for (auto& client : g_clients) {
+    if (!cached) {
+        g_latency_us = h264_stream_now_us() - capture_us;
+    }
+
+    h264_rtp_packetize(&g_rtp_frame, PAYLOAD_TYPE, g_h264_stream.codec == SOCK_CODEC_H265, data, size);
+    if (g_rtp_frame.packets.empty()) {
+        return;
+    }
+
+    auto clients = clients_snapshot();
+    for (auto& client : *clients) {
         if (!client->video_track || !client->video_track->isOpen()) {
             continue;
         }
 
+        // Each receiver report counts once.
+        uint32_t reports = client->reports.load(std::memory_order_acquire);
+        if (reports != client->reports_seen) {
+            client->reports_seen = reports;
+            if (client->fraction_lost > FALL_BEHIND_LOSS) {
+                fall_behind(*client);
+                continue;
+            }
+        }
+
+        if (client->wait_keyframe) {
+            if (!g_rtp_frame.keyframe) {
+                client->frames_dropped++;
+                continue;
+            }
+            client->wait_keyframe = false;
+        }
+
         try {
-            auto elapsed = std::chrono::duration<double>(now - client->start_time).count();
-            client->sr_reporter->rtpConfig->timestamp =
-                client->sr_reporter->rtpConfig->startTimestamp +
-                client->sr_reporter->rtpConfig->secondsToTimestamp(elapsed);
-
-            rtc::binary frame(
-                reinterpret_cast<const std::byte*>(data),
-                reinterpret_cast<const std::byte*>(data + size));
-            client->video_track->send(frame);
+            if (!client->first_pts_us) {
+                client->first_pts_us = pts_us;
+            }
+            uint64_t elapsed_us = pts_us > client->first_pts_us ? pts_us - client->first_pts_us : 0;
+            double elapsed = elapsed_us / 1000000.0;
+            auto& config = client->rtp_config;
+            config->timestamp = config->startTimestamp + config->secondsToTimestamp(elapsed);
+
+            bool sent = true;
+            for (const auto& packet : g_rtp_frame.packets) {
+                uint8_t *pkt = g_rtp_frame.buf.data() + packet.offset;
+                h264_rtp_stamp(pkt, config->sequenceNumber++, config->timestamp, config->ssrc);
+                if (!client->video_track->send(reinterpret_cast<const std::byte*>(pkt), packet.size)) {
+                    sent = false;
+                    break;
+                }
+            }
+
+            // The rest of a frame the transport refused is useless.
+            if (!sent) {
+                fall_behind(*client);
+                continue;
+            }
+            client->frames_sent++;
+            if (!cached) {
+                client->latency_us = h264_stream_now_us() - capture_us;
+            }
         } catch (...) {}
     }
 }
 
+// Caps the encoder at the lowest receiver estimate (REMB) of the viewers,
+// less some headroom for packet overhead and keyframes. The capture app
+// applies the lowest cap of all its clients, so RTSP viewers on the same
+// encoder get the reduced rate too. Small changes are not forwarded.
+static void update_bitrate() {
+    if (g_h264_stream.fd < 0) {
+        g_bitrate_kbps = 0;
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - g_bitrate_time < std::chrono::milliseconds(BITRATE_INTERVAL_MS)) {
+        return;
+    }
+
+    uint32_t kbps = 0;
+    auto clients = clients_snapshot();
+    for (auto& c : *clients) {
+        uint32_t estimate = c->remb_kbps;
+        if (estimate && (!kbps || estimate < kbps)) {
+            kbps = estimate;
+        }
+    }
+    kbps = (uint64_t)kbps * BITRATE_HEADROOM_PCT / 100;
+
+    uint32_t diff = kbps > g_bitrate_kbps ? kbps - g_bitrate_kbps : g_bitrate_kbps - kbps;
+    if (kbps == g_bitrate_kbps || (kbps && g_bitrate_kbps && diff * 10 < g_bitrate_kbps)) {
+        return;
+    }
+
+    if (g_debug) {
+        log_printf("Bitrate cap: %u kbps\n", kbps);
+    }
+    h264_stream_request_bitrate(&g_h264_stream, kbps);
+    g_bitrate_kbps = kbps;
+    g_bitrate_time = now;
+}
+
+static void print_stats() {
+    log_printf("Capture latency: %.1f ms\n", g_latency_us / 1000.0);
+    auto clients = clients_snapshot();
+    for (auto& c : *clients) {
+        if (!c->video_track || !c->video_track->isOpen()) {
+            continue;
+        }
+        log_printf("Client %s: sent %llu, dropped %llu, latency %.1f ms, loss %.0f%%, REMB %u kbps%s\n",
+            c->id.c_str(), (unsigned long long)c->frames_sent, (unsigned long long)c->frames_dropped,
+            c->latency_us / 1000.0, c->fraction_lost * 100 / 256.0, c->remb_kbps.load(),
+            c->wait_keyframe ? ", waiting for keyframe" : "");
+    }
+}
+
+static bool client_closed(const std::shared_ptr<Client>& c) {
+    return !c->pc || c->pc->state() == rtc::PeerConnection::State::Closed ||
+        c->pc->state() == rtc::PeerConnection::State::Failed;
+}
+
 static void cleanup_clients() {
-    std::lock_guard<std::mutex> lock(g_clients_mutex);
+    auto clients = clients_snapshot();
+    if (std::none_of(clients->begin(), clients->end(), client_closed)) {
+        return;
+    }
 
-    g_clients.remove_if([](const std::shared_ptr<Client>& c) {
-        if (!c->pc || c->pc->state() == rtc::PeerConnection::State::Closed ||
-            c->pc->state() == rtc::PeerConnection::State::Failed) {
+    update_clients([](ClientList& list) {
+        list.erase(std::remove_if(list.begin(), list.end(), [](const std::shared_ptr<Client>& c) {
+            if (!client_closed(c)) {
+                return false;
+            }
             // Explicitly close the PeerConnection to ensure UDP sockets are released
             try {
                 if (c->pc && c->pc->state() != rtc::PeerConnection::State::Closed) {
@@ -115,16 +320,15 @@ static void cleanup_clients() {
             } catch (...) {}
             log_errorf("Removed client %s\n", c->id.c_str());
             return true;
-        }
-        return false;
+        }), list.end());
     });
 }
 
 static void ping_clients() {
-    std::lock_guard<std::mutex> lock(g_clients_mutex);
     auto now = std::chrono::steady_clock::now();
 
-    for (auto& c : g_clients) {
+    auto clients = clients_snapshot();
+    for (auto& c : *clients) {
         auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - c->start_time).count();
 
         if (c->timeout_s > 0 && elapsed >= c->timeout_s) {
@@ -141,7 +345,7 @@ static void ping_clients() {
             continue;
         }
 
-        auto since_pong = std::chrono::duration_cast<std::chrono::milliseconds>(now - c->last_pong).count();
+        auto since_pong = std::chrono::duration_cast<std::chrono::milliseconds>(now - c->last_pong.load()).count();
         if (since_pong >= PONG_TIMEOUT_MS) {
             if (c->keepAlive) {
                 log_errorf("Client %s pong timeout\n", c->id.c_str());
@@ -164,8 +368,7 @@ static void ping_clients() {
 }
 
 static size_t client_count() {
-    std::lock_guard<std::mutex> lock(g_clients_mutex);
-    return g_clients.size();
+    return clients_snapshot()->size();
 }
 
 static std::shared_ptr<Client> create_client(const json& request) {
@@ -191,25 +394,62 @@ static std::shared_ptr<Client> create_client(const json& request) {
         }
     });
 
+    // Offer whatever the capture app encodes, as last seen by the main loop
+    // or the startup probe; this runs on the signaling thread, which must
+    // not wait for the socket. Browser support for H265 is still limited.
+    uint8_t codec = *g_stream_codec;
+    if (codec == SOCK_CODEC_NONE) {
+        log_errorf("Client %s: codec not known yet, offering H264\n", client->id.c_str());
+    }
+
     rtc::Description::Video media("video", rtc::Description::Direction::SendOnly);
-    media.addH264Codec(96);
+    if (codec == SOCK_CODEC_H265) {
+        media.addH265Codec(PAYLOAD_TYPE);
+    } else {
+        media.addH264Codec(PAYLOAD_TYPE);
+    }
     media.addSSRC(1, "video-stream");
 
     client->video_track = client->pc->addTrack(media);
 
+    // Only holds the per-client RTP state; send_frame() hands the track
+    // finished packets, so there is no packetizer in the chain.
     client->rtp_config = std::make_shared<rtc::RtpPacketizationConfig>(
-        1, "video-stream", 96, rtc::H264RtpPacketizer::ClockRate);
-
-    auto packetizer = std::make_shared<rtc::H264RtpPacketizer>(
-        rtc::NalUnit::Separator::LongStartSequence, client->rtp_config);
+        1, "video-stream", PAYLOAD_TYPE, rtc::H264RtpPacketizer::ClockRate);
 
     client->sr_reporter = std::make_shared<rtc::RtcpSrReporter>(client->rtp_config);
-    packetizer->addToChain(client->sr_reporter);
 
     auto nack_responder = std::make_shared<rtc::RtcpNackResponder>();
-    packetizer->addToChain(nack_responder);
+    client->sr_reporter->addToChain(nack_responder);
 
-    client->video_track->setMediaHandler(packetizer);
+    // PLI/FIR from the viewer: the H264 socket is owned by the main loop.
+    auto pli_handler = std::make_shared<rtc::PliHandler>([]() {
+        g_keyframe_request = true;
+    });
+    client->sr_reporter->addToChain(pli_handler);
+
+    // Receiver estimated maximum bitrate, sent by browsers for the
+    // goog-remb feedback libdatachannel offers with the codec.
+    auto remb_handler = std::make_shared<rtc::RembHandler>([weak_client](unsigned int bitrate) {
+        if (auto c = weak_client.lock()) {
+            c->remb_kbps = bitrate / 1000;
+        }
+    });
+    client->sr_reporter->addToChain(remb_handler);
+
+    auto rr_handler = std::make_shared<ReceiverReportHandler>(client->rtp_config->ssrc, [weak_client](uint8_t fraction_lost) {
+        if (auto c = weak_client.lock()) {
+            c->fraction_lost = fraction_lost;
+            c->reports.fetch_add(1, std::memory_order_release);
+        }
+    });
+    client->sr_reporter->addToChain(rr_handler);
+
+    client->video_track->setMediaHandler(client->sr_reporter);
+    client->video_track->onOpen([]() {
+        g_keyframe_request = true;
+        wake_main_loop();
+    });
 
     client->data_channel = client->pc->createDataChannel("keepalive");
     client->data_channel->onMessage([weak_client](auto) {
@@ -233,10 +473,9 @@ static std::shared_ptr<Client> create_client(const json& request) {
         client->timeout_s = MAX_SESSION_WITHOUT_TIMEOUT_S;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(g_clients_mutex);
-        g_clients.push_back(client);
-    }
+    update_clients([&](ClientList& list) {
+        list.push_back(client);
+    });
 
     return client;
 }
@@ -350,8 +589,18 @@ static json handle_request(const json& request) {
 static void handle_connection(int fd) {
     std::string line;
     char buf[65536];
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SIGNALING_TIMEOUT_MS);
 
     while (true) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+            log_errorf("Signaling request timed out\n");
+            close(fd);
+            return;
+        }
+
         ssize_t n = read(fd, buf, sizeof(buf) - 1);
         if (n <= 0) break;
         buf[n] = '\0';
@@ -381,6 +630,25 @@ static void handle_connection(int fd) {
     close(fd);
 }
 
+// Signaling has its own thread, so neither SDP negotiation nor a slow
+// client ever holds up the media loop. Requests are handled one at a time.
+static void signaling_loop(int listen_fd) {
+    while (g_running) {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        int client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            continue;
+        }
+
+        handle_connection(client_fd);
+        wake_main_loop();
+    }
+}
+
 static void signal_handler(int) {
     g_running = false;
 }
@@ -389,7 +657,7 @@ static void print_usage(const char* prog) {
     printf("Usage: %s [options]\n", prog);
     printf("Options:\n");
     printf("  --webrtc-sock <path>   Unix socket for WebRTC signaling\n");
-    printf("  --h264-sock <path>     H264 stream input socket\n");
+    printf("  --h264-sock <path>     H264 or H265 stream input socket\n");
     printf("  --max-clients <n>      Max concurrent clients (default: 4)\n");
     printf("  --stun <url>           STUN server URL (can be repeated)\n");
     printf("  --debug                Enable debug output\n");
@@ -490,27 +758,51 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    g_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_wake_fd < 0) {
+        log_perror("eventfd");
+        return 1;
+    }
+
     log_printf("WebRTC server running...\n");
 
+    h264_stream_probe_codec_async(g_h264_sock, g_stream_codec);
+    std::thread signaling_thread(signaling_loop, listen_fd);
+    auto last_stats = std::chrono::steady_clock::now();
+
     while (g_running) {
         struct pollfd pfd[] = {
-            {listen_fd, POLLIN, 0},
+            {g_wake_fd, POLLIN, 0},
             {g_h264_stream.fd, POLLIN, 0}
         };
         int ret = poll(pfd, 2, 1000);
 
         if (ret > 0 && (pfd[0].revents & POLLIN)) {
-            int client_fd = accept(listen_fd, nullptr, nullptr);
-            if (client_fd >= 0) {
-                handle_connection(client_fd);
+            uint64_t count;
+            if (read(g_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                log_perror("eventfd read");
             }
         }
         if (ret > 0 && (pfd[1].revents & POLLIN)) {
             h264_stream_process(&g_h264_stream, send_frame);
         }
+        if (g_h264_stream.fd >= 0 && g_h264_stream.codec != SOCK_CODEC_NONE) {
+            *g_stream_codec = g_h264_stream.codec;
+        }
+
+        if (g_keyframe_request.exchange(false)) {
+            h264_stream_request_keyframe(&g_h264_stream);
+        }
 
         ping_clients();
         cleanup_clients();
+        update_bitrate();
+
+        auto now = std::chrono::steady_clock::now();
+        if (g_debug && has_clients() && now - last_stats >= std::chrono::seconds(1)) {
+            print_stats();
+            last_stats = now;
+        }
 
         if (has_clients()) {
             h264_stream_open(&g_h264_stream, g_h264_sock.c_str());
@@ -521,7 +813,9 @@ int main(int argc, char* argv[]) {
 
     log_printf("Shutting down...\n");
 
+    signaling_thread.join();
     h264_stream_close(&g_h264_stream);
+    close(g_wake_fd);
     close(listen_fd);
     unlink(webrtc_sock.c_str());
     return 0;
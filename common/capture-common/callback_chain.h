@@ -1,19 +1,27 @@
 #ifndef CALLBACK_CHAIN_H
 #define CALLBACK_CHAIN_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+// Per-frame metadata passed along with the data; flags are SOCK_FRAME_*.
 typedef struct {
-    void (*cb)(const void *data, size_t size, void *arg);
+    uint64_t timestamp_us;
+    uint32_t flags;
+} frame_meta_t;
+
+typedef struct {
+    void (*cb)(const void *data, size_t size, const frame_meta_t *meta, void *arg);
     void *arg;
-    bool run;
+    atomic_bool run; // toggled by the capture loop while an encoder thread runs the chain
 } callback_chain_t;
 
 static inline bool callback_chain_active(callback_chain_t *chain)
 {
     while (chain->cb) {
-        if (chain->run) {
+        if (atomic_load(&chain->run)) {
             return true;
         }
         chain++;
@@ -21,13 +29,13 @@ static inline bool callback_chain_active(callback_chain_t *chain)
     return false;
 }
 
-static inline void callback_chain_write_cb(const void *data, size_t size, void *arg)
+static inline void callback_chain_write_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
 {
     callback_chain_t *chain = arg;
 
     while (chain->cb) {
-        if (chain->run) {
-            chain->cb(data, size, chain->arg);
+        if (atomic_load(&chain->run)) {
+            chain->cb(data, size, meta, chain->arg);
         }
         chain++;
     }
@@ -2,31 +2,164 @@
 #define MPP_ENC_CTX_H
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <rockchip/rk_mpi.h>
 #include <rockchip/mpp_buffer.h>
 #include <rockchip/mpp_frame.h>
 #include <rockchip/mpp_packet.h>
+#include <rockchip/mpp_meta.h>
 #include "log.h"
 
+#define MPP_ENC_MAX_IMPORTS 32
+#define MPP_ENC_POOL_SIZE 4
+#define MPP_ENC_QUEUE_SIZE 2
+#define MPP_ENC_MIN_BITRATE 100
+
+typedef struct {
+    int fd;
+    MppBuffer buf;
+} mpp_enc_import_t;
+
+typedef struct {
+    MppFrame frame;
+    MppBuffer buf;
+    bool busy;
+} mpp_enc_slot_t;
+
+typedef void (*mpp_enc_packet_cb_t)(MppPacket packet, void *opaque, void *arg);
+
+typedef struct {
+    mpp_enc_slot_t *slot;
+    void *opaque;
+} mpp_enc_job_t;
+
 typedef struct {
+    int fd;
+    size_t length;
+    void *data;
+    size_t size;
+    int force_idr;
+    void *opaque;
+} mpp_enc_input_t;
+
+typedef struct mpp_enc_ctx mpp_enc_ctx_t;
+typedef void (*mpp_enc_input_cb_t)(mpp_enc_ctx_t *ctx, const mpp_enc_input_t *input, void *arg);
+
+struct mpp_enc_ctx {
     MppCtx ctx;
     MppApi *mpi;
     MppBufferGroup buf_grp;
     MppEncCfg cfg;
     unsigned int width;
     unsigned int height;
+    unsigned int hor_stride;
+    unsigned int ver_stride;
+    size_t frame_size;
     MppFrameFormat fmt;
-} mpp_enc_ctx_t;
+    unsigned int bitrate;
+    unsigned int bitrate_now;
+    atomic_uint bitrate_req;
+    mpp_enc_slot_t slots[MPP_ENC_POOL_SIZE];
+    mpp_enc_import_t imports[MPP_ENC_MAX_IMPORTS];
+    int num_imports;
+    bool import_failed;
+    bool async;
+    bool stopping;
+    int depth;
+    mpp_enc_packet_cb_t packet_cb;
+    void *packet_arg;
+    mpp_enc_job_t jobs[MPP_ENC_POOL_SIZE];
+    int jobs_head;
+    int num_jobs;
+    pthread_t output_thread;
+    bool worker;
+    bool worker_stopping;
+    mpp_enc_input_cb_t input_cb;
+    void *input_arg;
+    mpp_enc_input_t inputs[MPP_ENC_QUEUE_SIZE];
+    int inputs_head;
+    int num_inputs;
+    pthread_t worker_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int frames_encoded;
+    atomic_int frames_dropped;
+};
+
+// Bytes per pixel of the first plane. MPP takes hor_stride in bytes, which
+// for the packed YUV and RGB formats is a multiple of the width.
+static unsigned int mpp_enc_bytes_per_pixel(MppFrameFormat fmt)
+{
+    switch (fmt) {
+    case MPP_FMT_YUV422_YUYV:
+    case MPP_FMT_YUV422_YVYU:
+    case MPP_FMT_YUV422_UYVY:
+    case MPP_FMT_YUV422_VYUY:
+        return 2;
+    case MPP_FMT_RGB888:
+    case MPP_FMT_BGR888:
+        return 3;
+    case MPP_FMT_YUV420SP:
+    case MPP_FMT_YUV420SP_VU:
+    case MPP_FMT_YUV420P:
+    case MPP_FMT_YUV422SP:
+    case MPP_FMT_YUV422SP_VU:
+    case MPP_FMT_YUV422P:
+        return 1;
+    default:
+        return 4;
+    }
+}
 
-__attribute__((unused)) static int mpp_jpeg_encoder_init(mpp_enc_ctx_t *ctx, unsigned int width, unsigned int height, MppFrameFormat fmt, unsigned int quality)
+static size_t mpp_enc_frame_size(MppFrameFormat fmt, unsigned int hor_stride, unsigned int ver_stride)
 {
-    MPP_RET ret;
+    size_t bytes = (size_t)hor_stride * ver_stride;
+
+    switch (fmt) {
+    case MPP_FMT_YUV420SP:
+    case MPP_FMT_YUV420SP_VU:
+    case MPP_FMT_YUV420P:
+        return bytes * 3 / 2;
+    case MPP_FMT_YUV422SP:
+    case MPP_FMT_YUV422SP_VU:
+    case MPP_FMT_YUV422P:
+        return bytes * 2;
+    default:
+        return bytes;
+    }
+}
+
+// hor_stride (in bytes, like V4L2 bytesperline) and ver_stride (in rows)
+// may be preset by the caller when the capture buffers are padded,
+// otherwise they default to the unpadded width/height.
+static void mpp_encoder_setup(mpp_enc_ctx_t *ctx, unsigned int width, unsigned int height, MppFrameFormat fmt)
+{
+    unsigned int min_stride = width * mpp_enc_bytes_per_pixel(fmt);
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
 
     ctx->width = width;
     ctx->height = height;
     ctx->fmt = fmt;
+    if (ctx->hor_stride < min_stride) {
+        ctx->hor_stride = min_stride;
+    }
+    if (ctx->ver_stride < height) {
+        ctx->ver_stride = height;
+    }
+    ctx->frame_size = mpp_enc_frame_size(fmt, ctx->hor_stride, ctx->ver_stride);
+}
+
+__attribute__((unused)) static int mpp_jpeg_encoder_init(mpp_enc_ctx_t *ctx, unsigned int width, unsigned int height, MppFrameFormat fmt, unsigned int quality)
+{
+    MPP_RET ret;
+
+    mpp_encoder_setup(ctx, width, height, fmt);
 
     ret = mpp_create(&ctx->ctx, &ctx->mpi);
     if (ret != MPP_OK) {
@@ -48,8 +181,8 @@ __attribute__((unused)) static int mpp_jpeg_encoder_init(mpp_enc_ctx_t *ctx, uns
 
     mpp_enc_cfg_set_s32(ctx->cfg, "prep:width", width);
     mpp_enc_cfg_set_s32(ctx->cfg, "prep:height", height);
-    mpp_enc_cfg_set_s32(ctx->cfg, "prep:hor_stride", width);
-    mpp_enc_cfg_set_s32(ctx->cfg, "prep:ver_stride", height);
+    mpp_enc_cfg_set_s32(ctx->cfg, "prep:hor_stride", ctx->hor_stride);
+    mpp_enc_cfg_set_s32(ctx->cfg, "prep:ver_stride", ctx->ver_stride);
     mpp_enc_cfg_set_s32(ctx->cfg, "prep:format", fmt);
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:mode", MPP_ENC_RC_MODE_FIXQP);
     mpp_enc_cfg_set_s32(ctx->cfg, "jpeg:quant", quality);
@@ -69,13 +202,19 @@ __attribute__((unused)) static int mpp_jpeg_encoder_init(mpp_enc_ctx_t *ctx, uns
     return 0;
 }
 
-__attribute__((unused)) static int mpp_h264_encoder_init(mpp_enc_ctx_t *ctx, unsigned int width, unsigned int height, MppFrameFormat fmt, unsigned int bitrate, unsigned int fps)
+// CBR around `kbps`, allowed to swing between half and one and a half times.
+static void mpp_enc_cfg_set_bitrate(MppEncCfg cfg, unsigned int kbps)
+{
+    mpp_enc_cfg_set_s32(cfg, "rc:bps_target", kbps * 1000);
+    mpp_enc_cfg_set_s32(cfg, "rc:bps_max", kbps * 1500);
+    mpp_enc_cfg_set_s32(cfg, "rc:bps_min", kbps * 500);
+}
+
+static int mpp_video_encoder_init(mpp_enc_ctx_t *ctx, unsigned int width, unsigned int height, MppFrameFormat fmt, unsigned int bitrate, unsigned int fps, MppCodingType coding)
 {
     MPP_RET ret;
 
-    ctx->width = width;
-    ctx->height = height;
-    ctx->fmt = fmt;
+    mpp_encoder_setup(ctx, width, height, fmt);
 
     ret = mpp_create(&ctx->ctx, &ctx->mpi);
     if (ret != MPP_OK) {
@@ -83,7 +222,7 @@ __attribute__((unused)) static int mpp_h264_encoder_init(mpp_enc_ctx_t *ctx, uns
         return -1;
     }
 
-    ret = mpp_init(ctx->ctx, MPP_CTX_ENC, MPP_VIDEO_CodingAVC);
+    ret = mpp_init(ctx->ctx, MPP_CTX_ENC, coding);
     if (ret != MPP_OK) {
         log_errorf("mpp_init failed: %d\n", ret);
         return -1;
@@ -97,13 +236,11 @@ __attribute__((unused)) static int mpp_h264_encoder_init(mpp_enc_ctx_t *ctx, uns
 
     mpp_enc_cfg_set_s32(ctx->cfg, "prep:width", width);
     mpp_enc_cfg_set_s32(ctx->cfg, "prep:height", height);
-    mpp_enc_cfg_set_s32(ctx->cfg, "prep:hor_stride", width);
-    mpp_enc_cfg_set_s32(ctx->cfg, "prep:ver_stride", height);
+    mpp_enc_cfg_set_s32(ctx->cfg, "prep:hor_stride", ctx->hor_stride);
+    mpp_enc_cfg_set_s32(ctx->cfg, "prep:ver_stride", ctx->ver_stride);
     mpp_enc_cfg_set_s32(ctx->cfg, "prep:format", fmt);
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:mode", MPP_ENC_RC_MODE_CBR);
-    mpp_enc_cfg_set_s32(ctx->cfg, "rc:bps_target", bitrate * 1000);
-    mpp_enc_cfg_set_s32(ctx->cfg, "rc:bps_max", bitrate * 1500);
-    mpp_enc_cfg_set_s32(ctx->cfg, "rc:bps_min", bitrate * 500);
+    mpp_enc_cfg_set_bitrate(ctx->cfg, bitrate);
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:fps_in_flex", 0);
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:fps_in_num", fps);
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:fps_in_denorm", 1);
@@ -111,11 +248,13 @@ __attribute__((unused)) static int mpp_h264_encoder_init(mpp_enc_ctx_t *ctx, uns
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:fps_out_num", fps);
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:fps_out_denorm", 1);
     mpp_enc_cfg_set_s32(ctx->cfg, "rc:gop", fps * 2);
-    mpp_enc_cfg_set_s32(ctx->cfg, "codec:type", MPP_VIDEO_CodingAVC);
-    mpp_enc_cfg_set_s32(ctx->cfg, "h264:profile", 100);
-    mpp_enc_cfg_set_s32(ctx->cfg, "h264:level", 41);
-    mpp_enc_cfg_set_s32(ctx->cfg, "h264:cabac_en", 1);
-    mpp_enc_cfg_set_s32(ctx->cfg, "h264:cabac_idc", 0);
+    mpp_enc_cfg_set_s32(ctx->cfg, "codec:type", coding);
+    if (coding == MPP_VIDEO_CodingAVC) {
+        mpp_enc_cfg_set_s32(ctx->cfg, "h264:profile", 100);
+        mpp_enc_cfg_set_s32(ctx->cfg, "h264:level", 41);
+        mpp_enc_cfg_set_s32(ctx->cfg, "h264:cabac_en", 1);
+        mpp_enc_cfg_set_s32(ctx->cfg, "h264:cabac_idc", 0);
+    }
 
     ret = ctx->mpi->control(ctx->ctx, MPP_ENC_SET_CFG, ctx->cfg);
     if (ret != MPP_OK) {
@@ -135,24 +274,98 @@ __attribute__((unused)) static int mpp_h264_encoder_init(mpp_enc_ctx_t *ctx, uns
         return -1;
     }
 
+    ctx->bitrate = bitrate;
+    ctx->bitrate_now = bitrate;
     return 0;
 }
 
+// Only the rc fields are sent, so the encoder is not reinitialized and no
+// IDR is forced. Must run on the thread that feeds the encoder.
+static int mpp_encoder_apply_bitrate(mpp_enc_ctx_t *ctx, unsigned int kbps)
+{
+    if (kbps == 0 || kbps > ctx->bitrate) {
+        kbps = ctx->bitrate;
+    } else if (kbps < MPP_ENC_MIN_BITRATE) {
+        kbps = MPP_ENC_MIN_BITRATE;
+    }
+    if (kbps == ctx->bitrate_now) {
+        return 0;
+    }
+
+    MppEncCfg cfg = NULL;
+    MPP_RET ret = mpp_enc_cfg_init(&cfg);
+    if (ret != MPP_OK) {
+        log_errorf("mpp_enc_cfg_init failed: %d\n", ret);
+        return -1;
+    }
+
+    ret = ctx->mpi->control(ctx->ctx, MPP_ENC_GET_CFG, cfg);
+    if (ret == MPP_OK) {
+        mpp_enc_cfg_set_bitrate(cfg, kbps);
+        ret = ctx->mpi->control(ctx->ctx, MPP_ENC_SET_CFG, cfg);
+    }
+    mpp_enc_cfg_deinit(cfg);
+
+    if (ret != MPP_OK) {
+        log_errorf("MPP_ENC_SET_CFG bitrate failed: %d\n", ret);
+        return -1;
+    }
+
+    log_printf("Encoder bitrate: %u kbps\n", kbps);
+    ctx->bitrate_now = kbps;
+    return 0;
+}
+
+// Retargets the rate control of a running H264/H265 encoder, e.g. to what
+// the viewers' network carries. `kbps` is capped at the bitrate the encoder
+// was set up with; 0 goes back to it. With a worker the request is only
+// recorded and the worker applies it between frames, so the config never
+// changes under a running encode. Cheap when nothing changes, so callers
+// may pass the current request for every frame.
+__attribute__((unused)) static int mpp_encoder_set_bitrate(mpp_enc_ctx_t *ctx, unsigned int kbps)
+{
+    if (!ctx->bitrate) {
+        return -1;
+    }
+
+    if (ctx->worker) {
+        atomic_store(&ctx->bitrate_req, kbps);
+        return 0;
+    }
+    return mpp_encoder_apply_bitrate(ctx, kbps);
+}
+
+__attribute__((unused)) static int mpp_h264_encoder_init(mpp_enc_ctx_t *ctx, unsigned int width, unsigned int height, MppFrameFormat fmt, unsigned int bitrate, unsigned int fps)
+{
+    return mpp_video_encoder_init(ctx, width, height, fmt, bitrate, fps, MPP_VIDEO_CodingAVC);
+}
+
+// HEVC Main profile with MPP's defaults; IDRs carry VPS/SPS/PPS.
+__attribute__((unused)) static int mpp_h265_encoder_init(mpp_enc_ctx_t *ctx, unsigned int width, unsigned int height, MppFrameFormat fmt, unsigned int bitrate, unsigned int fps)
+{
+    return mpp_video_encoder_init(ctx, width, height, fmt, bitrate, fps, MPP_VIDEO_CodingHEVC);
+}
+
+static void mpp_encoder_force_idr(mpp_enc_ctx_t *ctx, MppFrame frame)
+{
+    MPP_RET ret = ctx->mpi->control(ctx->ctx, MPP_ENC_SET_IDR_FRAME, NULL);
+    if (ret != MPP_OK) {
+        log_errorf("MPP_ENC_SET_IDR_FRAME failed: %d\n", ret);
+    }
+
+    MppMeta meta = mpp_frame_get_meta(frame);
+    if (meta) {
+        mpp_meta_set_s32(meta, KEY_INPUT_IDR_REQ, 1);
+    }
+}
+
 __attribute__((unused)) static MppPacket mpp_encode_mppframe(mpp_enc_ctx_t *ctx, MppFrame frame, int force_idr)
 {
     MPP_RET ret;
     MppPacket packet = NULL;
 
     if (force_idr) {
-        ret = ctx->mpi->control(ctx->ctx, MPP_ENC_SET_IDR_FRAME, NULL);
-        if (ret != MPP_OK) {
-            log_errorf("MPP_ENC_SET_IDR_FRAME failed: %d\n", ret);
-        }
-
-        MppMeta meta = mpp_frame_get_meta(frame);
-        if (meta) {
-            mpp_meta_set_s32(meta, KEY_INPUT_IDR_REQ, 1);
-        }
+        mpp_encoder_force_idr(ctx, frame);
     }
 
     ret = ctx->mpi->encode_put_frame(ctx->ctx, frame);
@@ -170,51 +383,435 @@ __attribute__((unused)) static MppPacket mpp_encode_mppframe(mpp_enc_ctx_t *ctx,
     return packet;
 }
 
-__attribute__((unused)) static MppPacket mpp_encode_frame(mpp_enc_ctx_t *ctx, void *data, size_t size, int force_idr)
+static mpp_enc_slot_t *mpp_encoder_get_slot(mpp_enc_ctx_t *ctx)
+{
+    for (int i = 0; i < MPP_ENC_POOL_SIZE; i++) {
+        mpp_enc_slot_t *slot = &ctx->slots[i];
+        if (slot->busy)
+            continue;
+
+        if (!slot->frame) {
+            MPP_RET ret = mpp_frame_init(&slot->frame);
+            if (ret != MPP_OK) {
+                log_errorf("mpp_frame_init failed: %d\n", ret);
+                return NULL;
+            }
+
+            mpp_frame_set_width(slot->frame, ctx->width);
+            mpp_frame_set_height(slot->frame, ctx->height);
+            mpp_frame_set_hor_stride(slot->frame, ctx->hor_stride);
+            mpp_frame_set_ver_stride(slot->frame, ctx->ver_stride);
+            mpp_frame_set_fmt(slot->frame, ctx->fmt);
+            mpp_frame_set_eos(slot->frame, 0);
+        }
+
+        MppMeta meta = mpp_frame_get_meta(slot->frame);
+        if (meta) {
+            mpp_meta_set_s32(meta, KEY_INPUT_IDR_REQ, 0);
+        }
+
+        slot->busy = true;
+        return slot;
+    }
+
+    log_errorf("mpp_encoder_get_slot: no free input frame\n");
+    return NULL;
+}
+
+static void mpp_encoder_put_slot(mpp_enc_slot_t *slot)
+{
+    slot->busy = false;
+}
+
+// Wraps an exported DMABUF fd as MppBuffer, cached per fd since
+// V4L2 hands out the same few buffers over and over.
+static MppBuffer mpp_encoder_import(mpp_enc_ctx_t *ctx, int fd, size_t length)
 {
     MPP_RET ret;
-    MppFrame frame = NULL;
-    MppPacket packet = NULL;
-    MppBuffer frame_buf = NULL;
-    size_t frame_size;
-    void *frame_ptr;
+    MppBuffer buf = NULL;
+    MppBufferInfo info;
 
-    frame_size = ctx->width * ctx->height * 3;
+    for (int i = 0; i < ctx->num_imports; i++) {
+        if (ctx->imports[i].fd == fd) {
+            return ctx->imports[i].buf;
+        }
+    }
 
-    ret = mpp_buffer_get(ctx->buf_grp, &frame_buf, frame_size);
-    if (ret != MPP_OK) {
-        log_errorf("mpp_buffer_get frame failed: %d\n", ret);
+    if (ctx->num_imports >= MPP_ENC_MAX_IMPORTS) {
+        log_errorf("mpp_encoder_import: too many buffers\n");
         return NULL;
     }
 
-    frame_ptr = mpp_buffer_get_ptr(frame_buf);
-    memcpy(frame_ptr, data, size < frame_size ? size : frame_size);
+    memset(&info, 0, sizeof(info));
+    info.type = MPP_BUFFER_TYPE_DRM;
+    info.size = length;
+    info.fd = fd;
 
-    ret = mpp_frame_init(&frame);
+    ret = mpp_buffer_import(&buf, &info);
     if (ret != MPP_OK) {
-        log_errorf("mpp_frame_init failed: %d\n", ret);
-        mpp_buffer_put(frame_buf);
+        log_errorf("mpp_buffer_import failed: %d\n", ret);
         return NULL;
     }
 
-    mpp_frame_set_width(frame, ctx->width);
-    mpp_frame_set_height(frame, ctx->height);
-    mpp_frame_set_hor_stride(frame, ctx->width);
-    mpp_frame_set_ver_stride(frame, ctx->height);
-    mpp_frame_set_fmt(frame, ctx->fmt);
-    mpp_frame_set_buffer(frame, frame_buf);
-    mpp_frame_set_eos(frame, 0);
+    ctx->imports[ctx->num_imports].fd = fd;
+    ctx->imports[ctx->num_imports].buf = buf;
+    ctx->num_imports++;
+
+    return buf;
+}
+
+// Points the slot frame at the DMABUF when it can be imported, otherwise
+// copies `data` into the slot's own buffer.
+static int mpp_encoder_fill_slot(mpp_enc_ctx_t *ctx, mpp_enc_slot_t *slot, int fd, size_t length, void *data, size_t size)
+{
+    if (fd >= 0 && !ctx->import_failed) {
+        MppBuffer buf = mpp_encoder_import(ctx, fd, length);
+        if (buf) {
+            mpp_frame_set_buffer(slot->frame, buf);
+            return 0;
+        }
+
+        log_errorf("DMABUF import failed, falling back to memcpy\n");
+        ctx->import_failed = true;
+    }
+
+    if (!slot->buf) {
+        MPP_RET ret = mpp_buffer_get(ctx->buf_grp, &slot->buf, ctx->frame_size);
+        if (ret != MPP_OK) {
+            log_errorf("mpp_buffer_get frame failed: %d\n", ret);
+            slot->buf = NULL;
+            return -1;
+        }
+    }
+
+    memcpy(mpp_buffer_get_ptr(slot->buf), data, size < ctx->frame_size ? size : ctx->frame_size);
+    mpp_frame_set_buffer(slot->frame, slot->buf);
+    return 0;
+}
 
-    packet = mpp_encode_mppframe(ctx, frame, force_idr);
+// Encodes straight from a DMABUF without touching the pixels. Falls back to
+// copying `data` if the buffer cannot be imported.
+__attribute__((unused)) static MppPacket mpp_encode_dmabuf(mpp_enc_ctx_t *ctx, int fd, size_t length, void *data, size_t size, int force_idr)
+{
+    MppPacket packet = NULL;
+    mpp_enc_slot_t *slot = mpp_encoder_get_slot(ctx);
+    if (!slot) {
+        return NULL;
+    }
 
-    mpp_frame_deinit(&frame);
-    mpp_buffer_put(frame_buf);
+    if (mpp_encoder_fill_slot(ctx, slot, fd, length, data, size) == 0) {
+        packet = mpp_encode_mppframe(ctx, slot->frame, force_idr);
+    }
 
+    mpp_encoder_put_slot(slot);
     return packet;
 }
 
+__attribute__((unused)) static MppPacket mpp_encode_frame(mpp_enc_ctx_t *ctx, void *data, size_t size, int force_idr)
+{
+    return mpp_encode_dmabuf(ctx, -1, 0, data, size, force_idr);
+}
+
+// True for H264/H265 packets holding an IDR frame. With
+// MPP_ENC_HEADER_MODE_EACH_IDR these also start with the parameter sets.
+__attribute__((unused)) static bool mpp_packet_is_intra(MppPacket packet)
+{
+    RK_S32 intra = 0;
+
+    if (!mpp_packet_has_meta(packet))
+        return false;
+    mpp_meta_get_s32(mpp_packet_get_meta(packet), KEY_OUTPUT_INTRA, &intra);
+    return intra != 0;
+}
+
+static void mpp_encoder_deliver(mpp_enc_ctx_t *ctx, MppPacket packet, void *opaque)
+{
+    if (packet) {
+        atomic_fetch_add(&ctx->frames_encoded, 1);
+    }
+    ctx->packet_cb(packet, opaque, ctx->packet_arg);
+}
+
+static void *mpp_encoder_output_thread(void *arg)
+{
+    mpp_enc_ctx_t *ctx = arg;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    while (1) {
+        while (ctx->num_jobs == 0 && !ctx->stopping) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->num_jobs == 0) {
+            break;
+        }
+
+        mpp_enc_job_t job = ctx->jobs[ctx->jobs_head];
+        pthread_mutex_unlock(&ctx->lock);
+
+        MppPacket packet = NULL;
+        MPP_RET ret = ctx->mpi->encode_get_packet(ctx->ctx, &packet);
+        if (ret != MPP_OK || !packet) {
+            log_errorf("encode_get_packet failed: %d\n", ret);
+            packet = NULL;
+        }
+
+        mpp_encoder_deliver(ctx, packet, job.opaque);
+
+        if (packet) {
+            mpp_packet_deinit(&packet);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (job.slot) {
+            mpp_encoder_put_slot(job.slot);
+        }
+        ctx->jobs_head = (ctx->jobs_head + 1) % MPP_ENC_POOL_SIZE;
+        ctx->num_jobs--;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// Packets produced by the worker or the async output thread are handed to
+// `cb` together with the opaque pointer of the frame they were encoded from.
+__attribute__((unused)) static void mpp_encoder_set_output(mpp_enc_ctx_t *ctx, mpp_enc_packet_cb_t cb, void *arg)
+{
+    ctx->packet_cb = cb;
+    ctx->packet_arg = arg;
+}
+
+// Packets are collected on a separate thread, in submission order.
+// Up to `depth` frames may be in flight at once.
+__attribute__((unused)) static int mpp_encoder_start_async(mpp_enc_ctx_t *ctx, int depth)
+{
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > MPP_ENC_POOL_SIZE) {
+        depth = MPP_ENC_POOL_SIZE;
+    }
+
+    ctx->depth = depth;
+    ctx->jobs_head = 0;
+    ctx->num_jobs = 0;
+    ctx->stopping = false;
+
+    if (pthread_create(&ctx->output_thread, NULL, mpp_encoder_output_thread, ctx) != 0) {
+        log_perror("pthread_create");
+        return -1;
+    }
+
+    ctx->async = true;
+    return 0;
+}
+
+static void mpp_encoder_stop_async(mpp_enc_ctx_t *ctx)
+{
+    if (!ctx->async) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_join(ctx->output_thread, NULL);
+    ctx->async = false;
+}
+
+static int mpp_encoder_submit(mpp_enc_ctx_t *ctx, mpp_enc_slot_t *slot, MppFrame frame, int force_idr, void *opaque)
+{
+    if (force_idr) {
+        mpp_encoder_force_idr(ctx, frame);
+    }
+
+    MPP_RET ret = ctx->mpi->encode_put_frame(ctx->ctx, frame);
+    if (ret != MPP_OK) {
+        log_errorf("encode_put_frame failed: %d\n", ret);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->jobs[(ctx->jobs_head + ctx->num_jobs) % MPP_ENC_POOL_SIZE] = (mpp_enc_job_t){ slot, opaque };
+    ctx->num_jobs++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return 0;
+}
+
+static void mpp_encoder_wait_ready(mpp_enc_ctx_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->num_jobs >= ctx->depth) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// The caller keeps ownership of `frame` until the packet callback runs.
+__attribute__((unused)) static int mpp_encode_mppframe_async(mpp_enc_ctx_t *ctx, MppFrame frame, int force_idr, void *opaque)
+{
+    mpp_encoder_wait_ready(ctx);
+    return mpp_encoder_submit(ctx, NULL, frame, force_idr, opaque);
+}
+
+// The DMABUF (or `data`) must stay valid until the packet callback runs.
+__attribute__((unused)) static int mpp_encode_dmabuf_async(mpp_enc_ctx_t *ctx, int fd, size_t length, void *data, size_t size, int force_idr, void *opaque)
+{
+    mpp_encoder_wait_ready(ctx);
+
+    pthread_mutex_lock(&ctx->lock);
+    mpp_enc_slot_t *slot = mpp_encoder_get_slot(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    if (!slot) {
+        return -1;
+    }
+
+    if (mpp_encoder_fill_slot(ctx, slot, fd, length, data, size) < 0 ||
+        mpp_encoder_submit(ctx, slot, slot->frame, force_idr, opaque) < 0) {
+        pthread_mutex_lock(&ctx->lock);
+        mpp_encoder_put_slot(slot);
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mpp_encoder_encode_input(mpp_enc_ctx_t *ctx, const mpp_enc_input_t *input, void *arg)
+{
+    (void)arg;
+
+    if (ctx->async) {
+        if (mpp_encode_dmabuf_async(ctx, input->fd, input->length, input->data, input->size, input->force_idr, input->opaque) < 0) {
+            ctx->packet_cb(NULL, input->opaque, ctx->packet_arg);
+        }
+        return;
+    }
+
+    MppPacket packet = mpp_encode_dmabuf(ctx, input->fd, input->length, input->data, input->size, input->force_idr);
+    mpp_encoder_deliver(ctx, packet, input->opaque);
+    if (packet) {
+        mpp_packet_deinit(&packet);
+    }
+}
+
+static void *mpp_encoder_worker_thread(void *arg)
+{
+    mpp_enc_ctx_t *ctx = arg;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    while (1) {
+        while (ctx->num_inputs == 0 && !ctx->worker_stopping) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->num_inputs == 0) {
+            break;
+        }
+
+        mpp_enc_input_t input = ctx->inputs[ctx->inputs_head];
+        ctx->inputs_head = (ctx->inputs_head + 1) % MPP_ENC_QUEUE_SIZE;
+        ctx->num_inputs--;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (ctx->bitrate) {
+            mpp_encoder_apply_bitrate(ctx, atomic_load(&ctx->bitrate_req));
+        }
+        ctx->input_cb(ctx, &input, ctx->input_arg);
+
+        pthread_mutex_lock(&ctx->lock);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// Runs the encoder on its own thread, fed by mpp_encoder_queue(). By default
+// each input is encoded from its DMABUF/data; `cb` can replace that step,
+// e.g. to decode first. Every queued input ends in exactly one packet
+// callback (with a NULL packet on failure) unless `cb` says otherwise.
+__attribute__((unused)) static int mpp_encoder_start_worker(mpp_enc_ctx_t *ctx, mpp_enc_input_cb_t cb, void *arg)
+{
+    ctx->input_cb = cb ? cb : mpp_encoder_encode_input;
+    ctx->input_arg = arg;
+    ctx->inputs_head = 0;
+    ctx->num_inputs = 0;
+    ctx->worker_stopping = false;
+
+    if (pthread_create(&ctx->worker_thread, NULL, mpp_encoder_worker_thread, ctx) != 0) {
+        log_perror("pthread_create");
+        return -1;
+    }
+
+    ctx->worker = true;
+    return 0;
+}
+
+// Never blocks: when the worker is still busy with earlier frames the input
+// is dropped and -1 returned, so the caller keeps ownership of it.
+__attribute__((unused)) static int mpp_encoder_queue(mpp_enc_ctx_t *ctx, const mpp_enc_input_t *input)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    if (ctx->num_inputs >= MPP_ENC_QUEUE_SIZE) {
+        pthread_mutex_unlock(&ctx->lock);
+        atomic_fetch_add(&ctx->frames_dropped, 1);
+        return -1;
+    }
+
+    ctx->inputs[(ctx->inputs_head + ctx->num_inputs) % MPP_ENC_QUEUE_SIZE] = *input;
+    ctx->num_inputs++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return 0;
+}
+
+// Drains and stops the worker and async output threads.
+static void mpp_encoder_stop(mpp_enc_ctx_t *ctx)
+{
+    if (ctx->worker) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->worker_stopping = true;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+
+        pthread_join(ctx->worker_thread, NULL);
+        ctx->worker = false;
+    }
+
+    mpp_encoder_stop_async(ctx);
+}
+
+// Returns the number of frames encoded and dropped since the last call.
+__attribute__((unused)) static void mpp_encoder_take_stats(mpp_enc_ctx_t *ctx, int *encoded, int *dropped)
+{
+    *encoded = atomic_exchange(&ctx->frames_encoded, 0);
+    *dropped = atomic_exchange(&ctx->frames_dropped, 0);
+}
+
 static void mpp_encoder_close(mpp_enc_ctx_t *ctx)
 {
+    mpp_encoder_stop(ctx);
+
+    for (int i = 0; i < MPP_ENC_POOL_SIZE; i++) {
+        if (ctx->slots[i].frame) {
+            mpp_frame_deinit(&ctx->slots[i].frame);
+        }
+        if (ctx->slots[i].buf) {
+            mpp_buffer_put(ctx->slots[i].buf);
+            ctx->slots[i].buf = NULL;
+        }
+    }
+    for (int i = 0; i < ctx->num_imports; i++) {
+        mpp_buffer_put(ctx->imports[i].buf);
+    }
+    ctx->num_imports = 0;
     if (ctx->cfg) {
         mpp_enc_cfg_deinit(ctx->cfg);
     }
@@ -0,0 +1,262 @@
+#ifndef SHM_RING_CTX_H
+#define SHM_RING_CTX_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "shm_ring.h"
+
+#define SHM_RING_MAX_CLIENTS 8
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+typedef struct {
+    const char *path;
+    int listen_fd;
+    int memfd;
+    int ro_fd;
+    void *map;
+    size_t map_size;
+    shm_ring_header_t *hdr;
+    int clients[SHM_RING_MAX_CLIENTS];
+    int num_clients;
+} shm_ring_ctx_t;
+
+#define DEFAULT_SHM_RING_CTX {.path = NULL, .listen_fd = -1, .memfd = -1, .ro_fd = -1, .clients = { [0 ... SHM_RING_MAX_CLIENTS - 1] = -1 }}
+
+static void shm_ring_close(shm_ring_ctx_t *ctx)
+{
+    for (int i = 0; i < SHM_RING_MAX_CLIENTS; i++) {
+        if (ctx->clients[i] >= 0) {
+            close(ctx->clients[i]);
+            ctx->clients[i] = -1;
+        }
+    }
+    ctx->num_clients = 0;
+
+    if (ctx->listen_fd >= 0) {
+        close(ctx->listen_fd);
+        ctx->listen_fd = -1;
+        unlink(ctx->path);
+    }
+    if (ctx->map) {
+        munmap(ctx->map, ctx->map_size);
+        ctx->map = NULL;
+        ctx->hdr = NULL;
+    }
+    if (ctx->ro_fd >= 0) {
+        close(ctx->ro_fd);
+        ctx->ro_fd = -1;
+    }
+    if (ctx->memfd >= 0) {
+        close(ctx->memfd);
+        ctx->memfd = -1;
+    }
+}
+
+static int shm_ring_open(shm_ring_ctx_t *ctx, const char *path, unsigned int num_slots, size_t frame_size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t slot_size = (SHM_RING_SLOT_HEADER + frame_size + page - 1) & ~(size_t)(page - 1);
+
+    ctx->path = path;
+    ctx->map_size = page + slot_size * num_slots;
+
+    ctx->memfd = memfd_create("v4l2-mpp-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ctx->memfd < 0) {
+        log_perror("memfd_create");
+        return -1;
+    }
+
+    if (ftruncate(ctx->memfd, ctx->map_size) < 0) {
+        log_perror("ftruncate");
+        goto error;
+    }
+
+    // Readers map the whole file, so it must never shrink under them.
+    if (fcntl(ctx->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        log_perror("F_ADD_SEALS");
+        goto error;
+    }
+
+    ctx->map = mmap(NULL, ctx->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->memfd, 0);
+    if (ctx->map == MAP_FAILED) {
+        log_perror("mmap");
+        ctx->map = NULL;
+        goto error;
+    }
+
+    // From here on only the mapping above can write: readers can neither
+    // write() nor map the memfd writable, not even after reopening it
+    // through /proc. F_SEAL_FUTURE_WRITE needs Linux 5.1; older kernels
+    // still have the read-only fd below.
+    if (fcntl(ctx->memfd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+        if (errno != EINVAL) {
+            log_perror("F_ADD_SEALS");
+            goto error;
+        }
+        log_printf("Kernel has no F_SEAL_FUTURE_WRITE, raw frame ring readers only get a read-only fd\n");
+        if (fcntl(ctx->memfd, F_ADD_SEALS, F_SEAL_SEAL) < 0) {
+            log_perror("F_ADD_SEALS");
+            goto error;
+        }
+    }
+
+    // Readers also get a read-only file, so PROT_WRITE fails on it outright.
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", ctx->memfd);
+    ctx->ro_fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+    if (ctx->ro_fd < 0) {
+        log_perror("open memfd read-only");
+        goto error;
+    }
+
+    ctx->hdr = ctx->map;
+    ctx->hdr->magic = SHM_RING_MAGIC;
+    ctx->hdr->version = SHM_RING_VERSION;
+    ctx->hdr->num_slots = num_slots;
+    ctx->hdr->slot_size = slot_size;
+    ctx->hdr->data_offset = page;
+
+    unlink(path);
+
+    ctx->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctx->listen_fd < 0) {
+        log_perror("socket");
+        goto error;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (bind(ctx->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_perror("bind");
+        close(ctx->listen_fd);
+        ctx->listen_fd = -1;
+        goto error;
+    }
+
+    chmod(path, 0777);
+
+    if (listen(ctx->listen_fd, SHM_RING_MAX_CLIENTS) < 0) {
+        log_perror("listen");
+        goto error;
+    }
+
+    int flags = fcntl(ctx->listen_fd, F_GETFL, 0);
+    fcntl(ctx->listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+    log_printf("Ring %s: %u slots of %zu bytes\n", path, num_slots, slot_size);
+    return 0;
+
+error:
+    shm_ring_close(ctx);
+    return -1;
+}
+
+static int shm_ring_send_fd(int client_fd, int memfd)
+{
+    uint32_t magic = SHM_RING_MAGIC;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &magic, sizeof(magic) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+
+    memset(cbuf, 0, sizeof(cbuf));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    return sendmsg(client_fd, &msg, MSG_NOSIGNAL) == sizeof(magic) ? 0 : -1;
+}
+
+// Hands the ring to new readers and forgets readers that went away.
+static void shm_ring_accept_clients(shm_ring_ctx_t *ctx)
+{
+    if (ctx->listen_fd < 0)
+        return;
+
+    for (int i = 0; i < SHM_RING_MAX_CLIENTS; i++) {
+        char c;
+        if (ctx->clients[i] >= 0 && recv(ctx->clients[i], &c, 1, MSG_DONTWAIT | MSG_PEEK) == 0) {
+            close(ctx->clients[i]);
+            ctx->clients[i] = -1;
+            ctx->num_clients--;
+            log_printf("Ring %s: client disconnected (total %d)\n", ctx->path, ctx->num_clients);
+        }
+    }
+
+    while (1) {
+        int client_fd = accept(ctx->listen_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_perror("accept");
+            break;
+        }
+
+        int flags = fcntl(client_fd, F_GETFL, 0);
+        fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
+
+        int slot = -1;
+        for (int i = 0; i < SHM_RING_MAX_CLIENTS; i++) {
+            if (ctx->clients[i] < 0) {
+                slot = i;
+                break;
+            }
+        }
+
+        if (slot < 0 || shm_ring_send_fd(client_fd, ctx->ro_fd) < 0) {
+            close(client_fd);
+            log_printf("Ring %s: rejected client\n", ctx->path);
+            continue;
+        }
+
+        ctx->clients[slot] = client_fd;
+        ctx->num_clients++;
+        log_printf("Ring %s: client connected (total %d)\n", ctx->path, ctx->num_clients);
+    }
+}
+
+// Publishes one frame into the next slot; never waits for readers.
+static void shm_ring_write(shm_ring_ctx_t *ctx, const void *data, const shm_ring_frame_t *info)
+{
+    shm_ring_header_t *hdr = ctx->hdr;
+    size_t size = info->size;
+
+    if (size > hdr->slot_size - SHM_RING_SLOT_HEADER) {
+        size = hdr->slot_size - SHM_RING_SLOT_HEADER;
+    }
+
+    uint64_t seq = atomic_load_explicit(&hdr->write_seq, memory_order_relaxed) + 1;
+    shm_ring_slot_t *slot = shm_ring_slot(hdr, seq);
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->timestamp_us = info->timestamp_us;
+    slot->fourcc = info->fourcc;
+    slot->width = info->width;
+    slot->height = info->height;
+    slot->stride = info->stride;
+    slot->size = size;
+    memcpy((uint8_t *)slot + SHM_RING_SLOT_HEADER, data, size);
+
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&hdr->write_seq, seq, memory_order_release);
+    atomic_fetch_add_explicit(&hdr->futex, 1, memory_order_release);
+    syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif
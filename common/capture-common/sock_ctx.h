@@ -2,16 +2,61 @@
 #define SOCK_CTX_H
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
-#include <sys/ioctl.h>
-#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <time.h>
 #include "log.h"
+#include "sock_proto.h"
+#include "callback_chain.h"
 
 #define SOCK_MAX_CLIENTS 8
 #define SOCK_IDLE_TIMEOUT_MS 3000
-#define SOCK_WRITE_TIMEOUT_MS 100
+#define SOCK_QUEUE_FRAMES 256
+#define SOCK_QUEUE_BYTES (16 * 1024 * 1024)
+#define SOCK_GOP_FRAMES 128
+#define SOCK_GOP_BYTES (8 * 1024 * 1024)
+#define SOCK_QUEUE_DROP_FRAMES 2
+#define SOCK_MAX_PENDING 2
+#define SOCK_RELEASE_TIMEOUT_MS 500
+#define SOCK_HELLO_WAIT_MS 100
+#define SOCK_KEYFRAME_INTERVAL_MS 250
+#define SOCK_POOL_FRAMES 4
+#define SOCK_EPOLL_RETRY_MS 100
+
+typedef void (*sock_release_cb_t)(void *opaque, void *arg);
+
+typedef struct sock_frame sock_frame_t;
+
+// Frames whose last reference is gone, kept with their capacity so a
+// socket that sends similar sized frames stops allocating.
+typedef struct {
+    pthread_mutex_t lock;
+    sock_frame_t *frames[SOCK_POOL_FRAMES];
+    int num_frames;
+} sock_frame_pool_t;
+
+// A frame is copied once and shared by the queues of all clients. Frames
+// carrying a DMA-buf fd stay referenced by each client until it sends
+// SOCK_MSG_RELEASE, and `release` runs once the last reference is gone.
+struct sock_frame {
+    atomic_int refs;
+    sock_frame_pool_t *pool;
+    size_t capacity;
+    int fd;
+    uint32_t token;
+    sock_release_cb_t release;
+    void *opaque;
+    void *release_arg;
+    sock_frame_header_t hdr;
+    size_t size;
+    uint8_t data[];
+};
 
 typedef struct {
     int fd;
@@ -19,6 +64,23 @@ typedef struct {
     struct timespec last_time;
     int num_frames;
     int num_dropped;
+    sock_frame_t *queue[SOCK_QUEUE_FRAMES];
+    int queue_head;
+    int queue_len;
+    int queue_cached; // leading queue entries sent as SOCK_FRAME_CACHED
+    size_t queue_bytes;
+    size_t offset;
+    bool want_out;
+    sock_frame_t *pending[SOCK_MAX_PENDING];
+    struct timespec pending_time[SOCK_MAX_PENDING];
+    int num_pending;
+    int num_expired;
+    uint8_t rx[sizeof(sock_msg_t)];
+    size_t rx_len;
+    bool wait_hello;
+    bool wait_keyframe;
+    bool framed;
+    uint32_t bitrate_kbps;
 } sock_client_t;
 
 #define DEFAULT_SOCK_CLIENT {.fd = -1}
@@ -27,13 +89,164 @@ typedef struct {
     const char *path;
     int listen_fd;
     sock_client_t clients[SOCK_MAX_CLIENTS];
-    int num_clients;
+    atomic_int num_clients; // read by the capture loop without the lock
     bool one_frame;
-    bool need_keyframe;
+    atomic_bool need_keyframe;
+    struct timespec keyframe_time;
+    atomic_uint bitrate_kbps;
     bool allow_drops;
+    bool gop_cache;
+    uint8_t codec;
+    uint64_t seq;
+    sock_frame_t *gop[SOCK_GOP_FRAMES];
+    int gop_len;
+    size_t gop_bytes;
+    pthread_mutex_t lock;
+    int epoll_fd;
+    int wake_fd;
+    bool writer;
+    bool stopping;
+    pthread_t writer_thread;
+    sock_release_cb_t release_cb;
+    void *release_arg;
+    atomic_uint next_token;
+    sock_frame_pool_t pool;
 } sock_ctx_t;
 
-#define DEFAULT_SOCK_CTX {.path = NULL, .listen_fd = -1}
+#define DEFAULT_SOCK_CTX {.path = NULL, .listen_fd = -1, .clients = { [0 ... SOCK_MAX_CLIENTS - 1] = DEFAULT_SOCK_CLIENT }, .lock = PTHREAD_MUTEX_INITIALIZER, .epoll_fd = -1, .wake_fd = -1, .pool = {.lock = PTHREAD_MUTEX_INITIALIZER}}
+
+static void sock_frame_unref(sock_frame_t *frame)
+{
+    if (atomic_fetch_sub(&frame->refs, 1) != 1) {
+        return;
+    }
+
+    if (frame->release) {
+        frame->release(frame->opaque, frame->release_arg);
+    }
+
+    sock_frame_pool_t *pool = frame->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->num_frames < SOCK_POOL_FRAMES) {
+        pool->frames[pool->num_frames++] = frame;
+        frame = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(frame);
+}
+
+// Takes a pooled frame that fits `size` bytes, or allocates a new one.
+static sock_frame_t *sock_frame_alloc(sock_frame_pool_t *pool, size_t size)
+{
+    sock_frame_t *frame = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (int n = 0; n < pool->num_frames; n++) {
+        if (pool->frames[n]->capacity >= size) {
+            frame = pool->frames[n];
+            pool->frames[n] = pool->frames[--pool->num_frames];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!frame) {
+        frame = malloc(sizeof(*frame) + size);
+        if (!frame) {
+            return NULL;
+        }
+        frame->capacity = size;
+        frame->pool = pool;
+    }
+    return frame;
+}
+
+static void sock_frame_pool_free(sock_frame_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    for (int n = 0; n < pool->num_frames; n++) {
+        free(pool->frames[n]);
+    }
+    pool->num_frames = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static long sock_elapsed_ms(const struct timespec *since, const struct timespec *now)
+{
+    return (now->tv_sec - since->tv_sec) * 1000 +
+           (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static size_t sock_client_frame_size(const sock_client_t *client, const sock_frame_t *frame)
+{
+    return (client->framed ? sizeof(frame->hdr) : 0) + frame->size;
+}
+
+static void sock_client_enqueue(sock_client_t *client, sock_frame_t *frame, const struct timespec *now)
+{
+    if (client->queue_len == 0) {
+        client->last_time = *now;
+    }
+
+    atomic_fetch_add(&frame->refs, 1);
+    client->queue[(client->queue_head + client->queue_len) % SOCK_QUEUE_FRAMES] = frame;
+    client->queue_len++;
+    client->queue_bytes += sock_client_frame_size(client, frame);
+}
+
+static void sock_gop_reset(sock_ctx_t *ctx)
+{
+    for (int n = 0; n < ctx->gop_len; n++) {
+        sock_frame_unref(ctx->gop[n]);
+    }
+    ctx->gop_len = 0;
+    ctx->gop_bytes = 0;
+}
+
+// Keeps the frames since the last keyframe that carried parameter sets.
+// A GOP that outgrows the cache is dropped until the next keyframe.
+static void sock_gop_add(sock_ctx_t *ctx, sock_frame_t *frame)
+{
+    uint32_t key = SOCK_FRAME_KEYFRAME | SOCK_FRAME_PARAM_SETS;
+
+    if ((frame->hdr.flags & key) == key) {
+        sock_gop_reset(ctx);
+    } else if (ctx->gop_len == 0) {
+        return;
+    }
+
+    if (ctx->gop_len == SOCK_GOP_FRAMES || ctx->gop_bytes + frame->size > SOCK_GOP_BYTES) {
+        sock_gop_reset(ctx);
+        return;
+    }
+
+    atomic_fetch_add(&frame->refs, 1);
+    ctx->gop[ctx->gop_len++] = frame;
+    ctx->gop_bytes += frame->size;
+}
+
+// Starts sending to a client once it said hello or the wait for it expired.
+// H264/H265 clients get the cached GOP so they can decode right away, or
+// start at the next keyframe, which is then requested from the encoder.
+static void sock_client_start(sock_ctx_t *ctx, sock_client_t *client)
+{
+    client->wait_hello = false;
+
+    if (ctx->gop_len > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int n = 0; n < ctx->gop_len; n++) {
+            sock_client_enqueue(client, ctx->gop[n], &now);
+        }
+        client->queue_cached = client->queue_len;
+        return;
+    }
+
+    client->wait_keyframe = ctx->codec == SOCK_CODEC_H264 || ctx->codec == SOCK_CODEC_H265;
+    ctx->need_keyframe = true;
+}
+
+static void *sock_writer_thread(void *arg);
 
 static int sock_open(sock_ctx_t *ctx, const char *path)
 {
@@ -77,18 +290,69 @@ static int sock_open(sock_ctx_t *ctx, const char *path)
     int flags = fcntl(ctx->listen_fd, F_GETFL, 0);
     fcntl(ctx->listen_fd, F_SETFL, flags | O_NONBLOCK);
 
+    ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->epoll_fd < 0 || ctx->wake_fd < 0) {
+        log_perror("epoll_create1/eventfd");
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = SOCK_MAX_CLIENTS };
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->wake_fd, &ev) < 0) {
+        log_perror("epoll_ctl");
+        return -1;
+    }
+
+    ctx->stopping = false;
+    if (pthread_create(&ctx->writer_thread, NULL, sock_writer_thread, ctx) != 0) {
+        log_perror("pthread_create");
+        return -1;
+    }
+    ctx->writer = true;
+
     return 0;
 }
 
+static void sock_wake_writer(sock_ctx_t *ctx)
+{
+    uint64_t one = 1;
+    if (write(ctx->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_perror("eventfd write");
+    }
+}
+
+static void sock_close_client(sock_ctx_t *ctx, int i, const char *reason);
+
 static void sock_close(sock_ctx_t *ctx)
 {
+    if (ctx->writer) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stopping = true;
+        pthread_mutex_unlock(&ctx->lock);
+        sock_wake_writer(ctx);
+        pthread_join(ctx->writer_thread, NULL);
+        ctx->writer = false;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
     for (int i = 0; i < SOCK_MAX_CLIENTS; i++) {
         if (ctx->clients[i].fd >= 0) {
-            close(ctx->clients[i].fd);
-            ctx->clients[i].fd = -1;
+            sock_close_client(ctx, i, "shutdown");
         }
     }
     ctx->num_clients = 0;
+    sock_gop_reset(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    sock_frame_pool_free(&ctx->pool);
+
+    if (ctx->epoll_fd >= 0) {
+        close(ctx->epoll_fd);
+        ctx->epoll_fd = -1;
+    }
+    if (ctx->wake_fd >= 0) {
+        close(ctx->wake_fd);
+        ctx->wake_fd = -1;
+    }
 
     if (ctx->listen_fd >= 0) {
         close(ctx->listen_fd);
@@ -119,6 +383,8 @@ static bool sock_accept_clients(sock_ctx_t *ctx)
         int flags = fcntl(client_fd, F_GETFL, 0);
         fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
 
+        pthread_mutex_lock(&ctx->lock);
+
         sock_client_t *slot = NULL;
         for (int i = 0; i < SOCK_MAX_CLIENTS; i++) {
             if (ctx->clients[i].fd < 0) {
@@ -127,26 +393,36 @@ static bool sock_accept_clients(sock_ctx_t *ctx)
             }
         }
 
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u32 = slot ? slot - ctx->clients : 0 };
+        if (slot && epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            log_perror("epoll_ctl");
+            slot = NULL;
+        }
+
         if (slot) {
+            *slot = (sock_client_t)DEFAULT_SOCK_CLIENT;
             slot->fd = client_fd;
-            slot->last_size = 0;
-            slot->num_frames = 0;
-            slot->num_dropped = 0;
             clock_gettime(CLOCK_MONOTONIC, &slot->last_time);
             ctx->num_clients++;
-            ctx->need_keyframe = true;
+            if (ctx->one_frame) {
+                sock_client_start(ctx, slot);
+            } else {
+                slot->wait_hello = true;
+            }
             accepted = true;
             log_printf("Socket %s: client connected (total %d)\n", ctx->path, ctx->num_clients);
         } else {
             close(client_fd);
             log_printf("Socket %s: rejected client, max reached\n", ctx->path);
         }
+
+        pthread_mutex_unlock(&ctx->lock);
     }
 
     return accepted;
 }
 
-static void sock_wait_fds(sock_ctx_t *socks[], int timeout_ms)
+__attribute__((unused)) static void sock_wait_fds(sock_ctx_t *socks[], int timeout_ms)
 {
     fd_set rfds;
     struct timeval tv;
@@ -172,55 +448,261 @@ static void sock_wait_fds(sock_ctx_t *socks[], int timeout_ms)
     select(maxfd + 1, &rfds, NULL, NULL, &tv);
 }
 
-static ssize_t sock_write_client_fd(int fd, const void *data, size_t size)
+// The lowest SOCK_MSG_BITRATE cap of the connected clients, 0 for none.
+// The capture loop hands it to the encoder.
+static void sock_update_bitrate(sock_ctx_t *ctx)
 {
-    const char *ptr = data;
-    size_t remaining = size;
-    struct timespec start, now;
+    uint32_t kbps = 0;
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i++) {
+        uint32_t cap = ctx->clients[i].fd >= 0 ? ctx->clients[i].bitrate_kbps : 0;
+        if (cap && (!kbps || cap < kbps)) {
+            kbps = cap;
+        }
+    }
 
-    while (remaining > 0) {
-        ssize_t written = send(fd, ptr, remaining, MSG_NOSIGNAL);
-        if (written < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                clock_gettime(CLOCK_MONOTONIC, &now);
-                long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
-                                  (now.tv_nsec - start.tv_nsec) / 1000000;
+    ctx->bitrate_kbps = kbps;
+}
+
+static void sock_close_client(sock_ctx_t *ctx, int i, const char *reason)
+{
+    sock_client_t *client = &ctx->clients[i];
+
+    assert(i >= 0 && i < SOCK_MAX_CLIENTS);
+    assert(client->fd >= 0);
+    assert(ctx->num_clients > 0);
+    log_printf("Socket %s: client %d %s, closing (frames=%d, dropped=%d, expired=%d)\n",
+               ctx->path, i, reason, client->num_frames, client->num_dropped, client->num_expired);
+
+    for (int n = 0; n < client->queue_len; n++) {
+        sock_frame_unref(client->queue[(client->queue_head + n) % SOCK_QUEUE_FRAMES]);
+    }
+    client->queue_len = 0;
+    client->queue_cached = 0;
+    client->queue_bytes = 0;
 
-                if (elapsed_ms >= SOCK_WRITE_TIMEOUT_MS) {
-                    errno = ETIMEDOUT;
-                    return -1;
+    for (int n = 0; n < client->num_pending; n++) {
+        sock_frame_unref(client->pending[n]);
+    }
+    client->num_pending = 0;
+
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    ctx->num_clients--;
+
+    if (client->bitrate_kbps) {
+        sock_update_bitrate(ctx);
+    }
+
+    // Nothing is encoded without clients, so the cached GOP would not be
+    // followed by the next frame any more.
+    if (ctx->num_clients == 0) {
+        sock_gop_reset(ctx);
+    }
+}
+
+static void sock_client_want_out(sock_ctx_t *ctx, int i, bool want_out)
+{
+    sock_client_t *client = &ctx->clients[i];
+    if (client->want_out == want_out)
+        return;
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0),
+        .data.u32 = i,
+    };
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+    client->want_out = want_out;
+}
+
+// Writes as much of the queue as the socket takes without blocking.
+// Returns -1 if the client was closed.
+static int sock_flush_client(sock_ctx_t *ctx, int i)
+{
+    sock_client_t *client = &ctx->clients[i];
+
+    while (client->queue_len > 0) {
+        struct iovec iov[2 * SOCK_QUEUE_FRAMES];
+        sock_frame_header_t cached_hdr[SOCK_QUEUE_FRAMES];
+        char cbuf[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg = { .msg_iov = iov };
+
+        // A frame with an fd goes out in its own sendmsg() so the fd
+        // arrives together with the first byte of its message.
+        for (int n = 0; n < client->queue_len; n++) {
+            sock_frame_t *frame = client->queue[(client->queue_head + n) % SOCK_QUEUE_FRAMES];
+            size_t skip = n == 0 ? client->offset : 0;
+            if (frame->fd >= 0 && n > 0)
+                break;
+            if (client->framed) {
+                // The frame is shared, so the flag goes on a copy of its header.
+                const sock_frame_header_t *hdr = &frame->hdr;
+                if (n < client->queue_cached) {
+                    cached_hdr[n] = frame->hdr;
+                    cached_hdr[n].flags |= SOCK_FRAME_CACHED;
+                    hdr = &cached_hdr[n];
                 }
+                if (skip < sizeof(frame->hdr)) {
+                    iov[msg.msg_iovlen].iov_base = (uint8_t *)hdr + skip;
+                    iov[msg.msg_iovlen].iov_len = sizeof(frame->hdr) - skip;
+                    msg.msg_iovlen++;
+                    skip = 0;
+                } else {
+                    skip -= sizeof(frame->hdr);
+                }
+            }
+            iov[msg.msg_iovlen].iov_base = frame->data + skip;
+            iov[msg.msg_iovlen].iov_len = frame->size - skip;
+            msg.msg_iovlen++;
+            if (frame->fd >= 0) {
+                if (skip == 0) {
+                    memset(cbuf, 0, sizeof(cbuf));
+                    msg.msg_control = cbuf;
+                    msg.msg_controllen = sizeof(cbuf);
+                    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                    cmsg->cmsg_level = SOL_SOCKET;
+                    cmsg->cmsg_type = SCM_RIGHTS;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                    memcpy(CMSG_DATA(cmsg), &frame->fd, sizeof(int));
+                }
+                break;
+            }
+        }
 
-                usleep(1000);
+        ssize_t written = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
                 continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sock_client_want_out(ctx, i, true);
+                return 0;
+            }
+            sock_close_client(ctx, i, "write error");
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &client->last_time);
+        client->queue_bytes -= written;
+
+        while (written > 0) {
+            sock_frame_t *frame = client->queue[client->queue_head];
+            size_t left = sock_client_frame_size(client, frame) - client->offset;
+            if ((size_t)written < left) {
+                client->offset += written;
+                break;
+            }
+
+            written -= left;
+            client->offset = 0;
+            client->last_size = frame->size;
+            client->num_frames++;
+            client->queue_head = (client->queue_head + 1) % SOCK_QUEUE_FRAMES;
+            client->queue_len--;
+            if (client->queue_cached > 0) {
+                client->queue_cached--;
+            }
+
+            if (frame->fd >= 0 && client->num_pending < SOCK_MAX_PENDING) {
+                client->pending[client->num_pending] = frame;
+                clock_gettime(CLOCK_MONOTONIC, &client->pending_time[client->num_pending]);
+                client->num_pending++;
+            } else {
+                sock_frame_unref(frame);
+            }
+
+            if (ctx->one_frame) {
+                sock_close_client(ctx, i, "one frame sent");
+                return -1;
             }
-            return written;
         }
-        ptr += written;
-        remaining -= written;
     }
 
-    return size;
+    sock_client_want_out(ctx, i, false);
+    return 0;
 }
 
-static void sock_close_client(sock_ctx_t *ctx, int i, const char *reason)
+static void sock_release_pending(sock_client_t *client, int n)
 {
-    assert(i >= 0 && i < SOCK_MAX_CLIENTS);
-    assert(ctx->clients[i].fd >= 0);
-    assert(ctx->num_clients > 0);
-    log_printf("Socket %s: client %d %s, closing (frames=%d, dropped=%d)\n",
-               ctx->path, i, reason, ctx->clients[i].num_frames, ctx->clients[i].num_dropped);
-    close(ctx->clients[i].fd);
-    ctx->clients[i].fd = -1;
-    ctx->num_clients--;
+    sock_frame_unref(client->pending[n]);
+    client->num_pending--;
+    memmove(&client->pending[n], &client->pending[n + 1], (client->num_pending - n) * sizeof(client->pending[0]));
+    memmove(&client->pending_time[n], &client->pending_time[n + 1], (client->num_pending - n) * sizeof(client->pending_time[0]));
 }
 
-static void sock_write_cb(const void *data, size_t size, void *arg)
+static void sock_handle_msg(sock_ctx_t *ctx, int i, const sock_msg_t *msg)
+{
+    sock_client_t *client = &ctx->clients[i];
+
+    switch (msg->type) {
+    case SOCK_MSG_RELEASE:
+        for (int n = 0; n < client->num_pending; n++) {
+            if (client->pending[n]->token == msg->value) {
+                sock_release_pending(client, n);
+                break;
+            }
+        }
+        break;
+    case SOCK_MSG_HELLO:
+        if (client->wait_hello) {
+            client->framed = (msg->value & SOCK_HELLO_FRAMED) != 0;
+            if (msg->value & SOCK_HELLO_PEEK) {
+                client->wait_hello = false;
+            } else {
+                sock_client_start(ctx, client);
+            }
+        }
+        break;
+    case SOCK_MSG_KEYFRAME: {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (ctx->need_keyframe ||
+            (ctx->keyframe_time.tv_sec && sock_elapsed_ms(&ctx->keyframe_time, &now) < SOCK_KEYFRAME_INTERVAL_MS))
+            break;
+        ctx->keyframe_time = now;
+        ctx->need_keyframe = true;
+        break;
+    }
+    case SOCK_MSG_BITRATE:
+        client->bitrate_kbps = msg->value;
+        sock_update_bitrate(ctx);
+        break;
+    default:
+        break;
+    }
+}
+
+static void sock_read_client(sock_ctx_t *ctx, int i)
+{
+    sock_client_t *client = &ctx->clients[i];
+
+    while (1) {
+        ssize_t n = recv(client->fd, client->rx + client->rx_len, sizeof(client->rx) - client->rx_len, MSG_DONTWAIT);
+        if (n > 0) {
+            client->rx_len += n;
+            if (client->rx_len == sizeof(client->rx)) {
+                sock_msg_t msg;
+                memcpy(&msg, client->rx, sizeof(msg));
+                client->rx_len = 0;
+                sock_handle_msg(ctx, i, &msg);
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        sock_close_client(ctx, i, n == 0 ? "disconnected" : "read error");
+        return;
+    }
+}
+
+// Releases buffers whose consumer did not return them in time.
+// Returns whether any buffer is still held by a client.
+static bool sock_expire_pending(sock_ctx_t *ctx)
 {
-    sock_ctx_t *ctx = arg;
     struct timespec now;
+    bool held = false;
 
     clock_gettime(CLOCK_MONOTONIC, &now);
 
@@ -229,40 +711,267 @@ static void sock_write_cb(const void *data, size_t size, void *arg)
         if (client->fd < 0)
             continue;
 
-        long idle_ms = (now.tv_sec - client->last_time.tv_sec) * 1000 +
-                       (now.tv_nsec - client->last_time.tv_nsec) / 1000000;
-        if (idle_ms >= SOCK_IDLE_TIMEOUT_MS) {
-            sock_close_client(ctx, i, "idle timeout");
-            continue;
+        while (client->num_pending > 0 &&
+               sock_elapsed_ms(&client->pending_time[0], &now) >= SOCK_RELEASE_TIMEOUT_MS) {
+            if (client->num_expired++ == 0) {
+                log_printf("Socket %s: client %d did not release a buffer in %d ms\n",
+                           ctx->path, i, SOCK_RELEASE_TIMEOUT_MS);
+            }
+            sock_release_pending(client, 0);
         }
+        held |= client->num_pending > 0;
+    }
 
-        if (ctx->allow_drops && client->last_size) {
-            int unsent = 0;
-            if (ioctl(client->fd, SIOCOUTQ, &unsent) == 0) {
-                if ((size_t)unsent >= client->last_size) {
-                    client->num_dropped++;
-                    continue;
+    return held;
+}
+
+static void *sock_writer_thread(void *arg)
+{
+    sock_ctx_t *ctx = arg;
+    struct epoll_event events[SOCK_MAX_CLIENTS + 1];
+    int timeout_ms = -1;
+
+    while (1) {
+        int n = epoll_wait(ctx->epoll_fd, events, SOCK_MAX_CLIENTS + 1, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_perror("epoll_wait");
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+
+        if (ctx->stopping) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+
+        // Clients would never be written to again, so drop them all, which
+        // stops the encoders, and keep trying for those that come next.
+        if (n < 0) {
+            for (int i = 0; i < SOCK_MAX_CLIENTS; i++) {
+                if (ctx->clients[i].fd >= 0) {
+                    sock_close_client(ctx, i, "epoll error");
                 }
             }
+            pthread_mutex_unlock(&ctx->lock);
+            usleep(SOCK_EPOLL_RETRY_MS * 1000);
+            continue;
         }
 
-        if (sock_write_client_fd(client->fd, data, size) < 0) {
-            if (errno == ETIMEDOUT) {
-                sock_close_client(ctx, i, "write timeout");
-            } else {
-                sock_close_client(ctx, i, "write error");
+        for (int e = 0; e < n; e++) {
+            uint32_t i = events[e].data.u32;
+
+            if (i == SOCK_MAX_CLIENTS) {
+                uint64_t count;
+                if (read(ctx->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    log_perror("eventfd read");
+                }
+                for (int c = 0; c < SOCK_MAX_CLIENTS; c++) {
+                    if (ctx->clients[c].fd >= 0 && !ctx->clients[c].want_out) {
+                        sock_flush_client(ctx, c);
+                    }
+                }
+                continue;
+            }
+
+            if (ctx->clients[i].fd < 0)
+                continue;
+
+            if (events[e].events & (EPOLLHUP | EPOLLERR)) {
+                sock_close_client(ctx, i, "disconnected");
+                continue;
+            }
+            if (events[e].events & (EPOLLIN | EPOLLRDHUP)) {
+                sock_read_client(ctx, i);
+                if (ctx->clients[i].fd < 0)
+                    continue;
+            }
+            // Also flush frames queued by a hello, unless the socket is full.
+            if ((events[e].events & EPOLLOUT) ||
+                (!ctx->clients[i].want_out && ctx->clients[i].queue_len > 0)) {
+                sock_flush_client(ctx, i);
             }
+        }
+
+        timeout_ms = sock_expire_pending(ctx) ? SOCK_RELEASE_TIMEOUT_MS / 10 : -1;
+
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    return NULL;
+}
+
+// Makes room for one more frame. Sockets that allow drops lose their oldest
+// frame that is not being written yet; any other client is disconnected.
+static bool sock_queue_make_room(sock_ctx_t *ctx, int i, size_t size)
+{
+    sock_client_t *client = &ctx->clients[i];
+    int max_frames = ctx->allow_drops ? SOCK_QUEUE_DROP_FRAMES : SOCK_QUEUE_FRAMES;
+
+    while ((client->queue_len > 0 || client->num_pending > 0) &&
+           (client->queue_len + client->num_pending >= max_frames || client->queue_bytes + size > SOCK_QUEUE_BYTES)) {
+        if (!ctx->allow_drops) {
+            sock_close_client(ctx, i, "queue overflow");
+            return false;
+        }
+
+        int first = client->offset > 0 ? 1 : 0;
+        if (client->queue_len <= first) {
+            client->num_dropped++;
+            return false;
+        }
+
+        int at = (client->queue_head + first) % SOCK_QUEUE_FRAMES;
+        sock_frame_t *frame = client->queue[at];
+        client->queue_bytes -= sock_client_frame_size(client, frame);
+        for (int n = first; n < client->queue_len - 1; n++) {
+            client->queue[(client->queue_head + n) % SOCK_QUEUE_FRAMES] =
+                client->queue[(client->queue_head + n + 1) % SOCK_QUEUE_FRAMES];
+        }
+        client->queue_len--;
+        if (first < client->queue_cached) {
+            client->queue_cached--;
+        }
+        client->num_dropped++;
+        sock_frame_unref(frame);
+    }
+
+    return true;
+}
+
+static sock_frame_t *sock_frame_new(sock_ctx_t *ctx, const struct iovec *iov, int iovcnt, size_t size, uint32_t flags, uint64_t seq,
+                                    const frame_meta_t *meta, int fd, uint32_t token, void *opaque)
+{
+    sock_frame_t *frame = sock_frame_alloc(&ctx->pool, size);
+    if (!frame) {
+        log_perror("malloc");
+        return NULL;
+    }
+
+    atomic_init(&frame->refs, 1);
+    frame->fd = fd;
+    frame->token = token;
+    frame->release = fd >= 0 ? ctx->release_cb : NULL;
+    frame->opaque = opaque;
+    frame->release_arg = ctx->release_arg;
+    frame->hdr = (sock_frame_header_t){
+        .magic = SOCK_FRAME_MAGIC,
+        .hdr_size = sizeof(frame->hdr),
+        .codec = ctx->codec,
+        .flags = flags,
+        .length = size,
+        .seq = seq,
+        .timestamp_us = meta ? meta->timestamp_us : 0,
+    };
+    frame->size = size;
+
+    uint8_t *ptr = frame->data;
+    for (int n = 0; n < iovcnt; n++) {
+        memcpy(ptr, iov[n].iov_base, iov[n].iov_len);
+        ptr += iov[n].iov_len;
+    }
+    return frame;
+}
+
+static void sock_queue_frame(sock_ctx_t *ctx, const struct iovec *iov, int iovcnt, const frame_meta_t *meta, int fd, uint32_t token, void *opaque)
+{
+    struct timespec now;
+    size_t size = 0;
+
+    for (int n = 0; n < iovcnt; n++) {
+        size += iov[n].iov_len;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&ctx->lock);
+
+    sock_frame_t *frame = NULL;
+    bool queued = false;
+    bool cache = ctx->gop_cache && fd < 0;
+    uint32_t flags = meta ? meta->flags : 0;
+    uint64_t seq = ++ctx->seq;
+
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i++) {
+        sock_client_t *client = &ctx->clients[i];
+        if (client->fd < 0)
+            continue;
+
+        if (client->wait_hello) {
+            if (sock_elapsed_ms(&client->last_time, &now) < SOCK_HELLO_WAIT_MS)
+                continue;
+            sock_client_start(ctx, client);
+        }
+
+        if (client->wait_keyframe) {
+            if (!(flags & SOCK_FRAME_KEYFRAME))
+                continue;
+            client->wait_keyframe = false;
+        }
+
+        if (client->queue_len > 0 && sock_elapsed_ms(&client->last_time, &now) >= SOCK_IDLE_TIMEOUT_MS) {
+            sock_close_client(ctx, i, "idle timeout");
             continue;
         }
 
-        client->last_size = size;
-        client->last_time = now;
-        client->num_frames++;
+        if (!sock_queue_make_room(ctx, i, size))
+            continue;
 
-        if (ctx->one_frame) {
-            sock_close_client(ctx, i, "one frame sent");
+        if (!frame) {
+            frame = sock_frame_new(ctx, iov, iovcnt, size, flags, seq, meta, fd, token, opaque);
+            if (!frame)
+                break;
         }
+
+        sock_client_enqueue(client, frame, &now);
+        queued = true;
+    }
+
+    // The cache must see every frame, also those no client took yet.
+    if (cache && !frame && ctx->num_clients > 0) {
+        frame = sock_frame_new(ctx, iov, iovcnt, size, flags, seq, meta, fd, token, opaque);
+    }
+    if (cache && frame) {
+        sock_gop_add(ctx, frame);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (frame) {
+        sock_frame_unref(frame);
+    } else if (fd >= 0 && ctx->release_cb) {
+        ctx->release_cb(opaque, ctx->release_arg);
+    }
+    if (queued) {
+        sock_wake_writer(ctx);
     }
 }
 
+// Queues one frame, gathered from `iovcnt` parts, to every client. Never
+// blocks on a socket; the writer thread does the actual sending.
+static void sock_write_iov(sock_ctx_t *ctx, const struct iovec *iov, int iovcnt, const frame_meta_t *meta)
+{
+    sock_queue_frame(ctx, iov, iovcnt, meta, -1, 0, NULL);
+}
+
+// Hands a DMA-buf to every client without copying it. `fd` must stay valid
+// until ctx->release_cb runs with `opaque`, which happens once all clients
+// released the buffer or SOCK_RELEASE_TIMEOUT_MS passed.
+__attribute__((unused)) static void sock_write_dmabuf(sock_ctx_t *ctx, int fd, sock_dmabuf_desc_t *desc, void *opaque)
+{
+    desc->magic = SOCK_DMABUF_MAGIC;
+    desc->token = atomic_fetch_add(&ctx->next_token, 1) + 1;
+
+    struct iovec iov = { .iov_base = desc, .iov_len = sizeof(*desc) };
+    frame_meta_t meta = { .timestamp_us = desc->timestamp_us };
+    sock_queue_frame(ctx, &iov, 1, &meta, fd, desc->token, opaque);
+}
+
+static void sock_write_cb(const void *data, size_t size, const frame_meta_t *meta, void *arg)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+    sock_write_iov(arg, &iov, 1, meta);
+}
+
 #endif
@@ -4,22 +4,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <linux/videodev2.h>
 #include "log.h"
 
-#define V4L2_BUFFERS 4
+#define V4L2_BUFFERS 6
+#define V4L2_MAX_BUFFERS 8 // each one is a full raw frame of CMA
+#define V4L2_MIN_QUEUED 2 // left with the driver so capture never stalls
 #define V4L2_MAX_PLANES 4
 
 typedef struct {
     void *start[V4L2_MAX_PLANES];
     size_t length[V4L2_MAX_PLANES];
+    int dmabuf_fd[V4L2_MAX_PLANES];
     unsigned int num_planes;
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[V4L2_MAX_PLANES];
+    atomic_int refs;
 } v4l2_buffer_t;
 
 typedef struct {
@@ -29,12 +37,20 @@ typedef struct {
     unsigned int width;
     unsigned int height;
     unsigned int pixfmt;
+    unsigned int bytesperline;
     enum v4l2_buf_type buf_type;
     unsigned int num_planes;
+    unsigned int num_buffers; // to request, 0 for V4L2_BUFFERS
+    atomic_int num_held;
 } v4l2_capture_t;
 
 #define DEFAULT_V4L2_CAPTURE {.fd = -1}
 
+__attribute__((unused)) static uint64_t v4l2_timestamp_us(const struct v4l2_buffer *buf)
+{
+    return buf->timestamp.tv_sec * 1000000ULL + buf->timestamp.tv_usec;
+}
+
 static int v4l2_ioctl(int fd, int request, void *arg)
 {
     int r;
@@ -44,6 +60,36 @@ static int v4l2_ioctl(int fd, int request, void *arg)
     return r;
 }
 
+static int v4l2_capture_export_buffer(v4l2_capture_t *ctx, unsigned int index)
+{
+    v4l2_buffer_t *buffer = &ctx->buffers[index];
+
+    for (unsigned int p = 0; p < buffer->num_planes; p++) {
+        struct v4l2_exportbuffer expbuf;
+
+        memset(&expbuf, 0, sizeof(expbuf));
+        expbuf.type = ctx->buf_type;
+        expbuf.index = index;
+        expbuf.plane = p;
+        expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+        if (v4l2_ioctl(ctx->fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+            // Don't leak the planes already exported; keep errno for the caller.
+            int err = errno;
+            for (unsigned int q = 0; q < p; q++) {
+                close(buffer->dmabuf_fd[q]);
+                buffer->dmabuf_fd[q] = -1;
+            }
+            errno = err;
+            return -1;
+        }
+
+        buffer->dmabuf_fd[p] = expbuf.fd;
+    }
+
+    return 0;
+}
+
 static int v4l2_capture_open(v4l2_capture_t *ctx, const char *device, unsigned int width, unsigned int height, unsigned int pixfmt, unsigned int fps, unsigned int requested_planes)
 {
     struct v4l2_capability cap;
@@ -103,15 +149,17 @@ static int v4l2_capture_open(v4l2_capture_t *ctx, const char *device, unsigned i
         ctx->width = fmt.fmt.pix_mp.width;
         ctx->height = fmt.fmt.pix_mp.height;
         ctx->pixfmt = fmt.fmt.pix_mp.pixelformat;
+        ctx->bytesperline = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
         ctx->num_planes = (requested_planes > 0) ? requested_planes : fmt.fmt.pix_mp.num_planes;
     } else {
         ctx->width = fmt.fmt.pix.width;
         ctx->height = fmt.fmt.pix.height;
         ctx->pixfmt = fmt.fmt.pix.pixelformat;
+        ctx->bytesperline = fmt.fmt.pix.bytesperline;
         ctx->num_planes = (requested_planes > 0) ? requested_planes : 1;
     }
 
-    log_printf("V4L2: %ux%u format=0x%08x planes=%u\n", ctx->width, ctx->height, ctx->pixfmt, ctx->num_planes);
+    log_printf("V4L2: %ux%u format=0x%08x planes=%u stride=%u\n", ctx->width, ctx->height, ctx->pixfmt, ctx->num_planes, ctx->bytesperline);
 
     if (fps > 0) {
         struct v4l2_streamparm parm;
@@ -129,7 +177,7 @@ static int v4l2_capture_open(v4l2_capture_t *ctx, const char *device, unsigned i
     }
 
     memset(&req, 0, sizeof(req));
-    req.count = V4L2_BUFFERS;
+    req.count = ctx->num_buffers ? ctx->num_buffers : V4L2_BUFFERS;
     req.type = ctx->buf_type;
     req.memory = V4L2_MEMORY_MMAP;
 
@@ -140,6 +188,13 @@ static int v4l2_capture_open(v4l2_capture_t *ctx, const char *device, unsigned i
 
     ctx->buffers = calloc(req.count, sizeof(v4l2_buffer_t));
     ctx->n_buffers = req.count;
+    log_printf("V4L2: %u buffers\n", req.count);
+
+    for (unsigned int i = 0; i < req.count; i++) {
+        for (unsigned int p = 0; p < V4L2_MAX_PLANES; p++) {
+            ctx->buffers[i].dmabuf_fd[p] = -1;
+        }
+    }
 
     for (unsigned int i = 0; i < req.count; i++) {
         struct v4l2_buffer buf;
@@ -189,6 +244,26 @@ static int v4l2_capture_open(v4l2_capture_t *ctx, const char *device, unsigned i
         }
     }
 
+    unsigned int exported = 0;
+    for (unsigned int i = 0; i < req.count; i++) {
+        if (v4l2_capture_export_buffer(ctx, i) < 0) {
+            log_printf("V4L2: VIDIOC_EXPBUF failed (%s), using memcpy path\n", strerror(errno));
+            break;
+        }
+        exported++;
+    }
+
+    if (exported < req.count) {
+        for (unsigned int i = 0; i < exported; i++) {
+            for (unsigned int p = 0; p < ctx->buffers[i].num_planes; p++) {
+                close(ctx->buffers[i].dmabuf_fd[p]);
+                ctx->buffers[i].dmabuf_fd[p] = -1;
+            }
+        }
+    } else {
+        log_printf("V4L2: exported %u buffers as DMABUF\n", exported);
+    }
+
     return 0;
 }
 
@@ -295,11 +370,50 @@ static int v4l2_capture_release_frame(v4l2_capture_t *ctx, struct v4l2_buffer *b
     return 0;
 }
 
+// Keeps a dequeued buffer around so it can be returned to the driver later,
+// possibly from another thread, once the last reference is dropped.
+static void v4l2_capture_hold_frame(v4l2_capture_t *ctx, struct v4l2_buffer *buf)
+{
+    v4l2_buffer_t *buffer = &ctx->buffers[buf->index];
+
+    buffer->buf = *buf;
+    if (ctx->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        memcpy(buffer->planes, buf->m.planes, sizeof(struct v4l2_plane) * buf->length);
+        buffer->buf.m.planes = buffer->planes;
+    }
+    atomic_store(&buffer->refs, 1);
+    atomic_fetch_add(&ctx->num_held, 1);
+}
+
+// True while holding on to dequeued buffers still leaves the driver
+// V4L2_MIN_QUEUED to capture into.
+__attribute__((unused)) static bool v4l2_capture_can_hold(v4l2_capture_t *ctx)
+{
+    return (int)ctx->n_buffers - atomic_load(&ctx->num_held) >= V4L2_MIN_QUEUED;
+}
+
+static void v4l2_capture_ref_frame(v4l2_capture_t *ctx, unsigned int index)
+{
+    atomic_fetch_add(&ctx->buffers[index].refs, 1);
+}
+
+static int v4l2_capture_unref_frame(v4l2_capture_t *ctx, unsigned int index)
+{
+    if (atomic_fetch_sub(&ctx->buffers[index].refs, 1) != 1) {
+        return 0;
+    }
+    atomic_fetch_sub(&ctx->num_held, 1);
+    return v4l2_capture_release_frame(ctx, &ctx->buffers[index].buf);
+}
+
 static void v4l2_capture_close(v4l2_capture_t *ctx)
 {
     for (unsigned int i = 0; i < ctx->n_buffers; i++) {
         for (unsigned int p = 0; p < ctx->buffers[i].num_planes; p++) {
             munmap(ctx->buffers[i].start[p], ctx->buffers[i].length[p]);
+            if (ctx->buffers[i].dmabuf_fd[p] >= 0) {
+                close(ctx->buffers[i].dmabuf_fd[p]);
+            }
         }
     }
     free(ctx->buffers);
@@ -0,0 +1,250 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+// Shared memory frame ring: layout shared by the producer (shm_ring_ctx.h)
+// and the reader below.
+//
+// The producer creates a sealed memfd holding a header followed by
+// `num_slots` slots, and hands a read-only fd to it out over a Unix socket
+// with SCM_RIGHTS. Seals keep readers from ever mapping it writable. Frames are written round-robin and the producer
+// never waits for readers. Each slot has a sequence number that is 0 while
+// the slot is being written, so readers can tell when a frame was overwritten
+// under them. `futex` is bumped after every frame for wake-ups.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "log.h"
+
+#define SHM_RING_MAGIC 0x474e4952 // "RING"
+#define SHM_RING_VERSION 1
+#define SHM_RING_SLOT_HEADER 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t data_offset;
+    _Atomic uint32_t futex;
+    _Atomic uint64_t write_seq;
+} shm_ring_header_t;
+
+typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t timestamp_us;
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t size;
+} shm_ring_slot_t;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t timestamp_us;
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t size;
+    uint64_t dropped;
+} shm_ring_frame_t;
+
+typedef struct {
+    int sock_fd;
+    void *map;
+    size_t map_size;
+    const shm_ring_header_t *hdr;
+    uint64_t last_seq;
+} shm_ring_reader_t;
+
+#define DEFAULT_SHM_RING_READER {.sock_fd = -1}
+
+static inline shm_ring_slot_t *shm_ring_slot(const shm_ring_header_t *hdr, uint64_t seq)
+{
+    uintptr_t base = (uintptr_t)hdr + hdr->data_offset;
+    return (shm_ring_slot_t *)(base + (size_t)((seq - 1) % hdr->num_slots) * hdr->slot_size);
+}
+
+static inline const uint8_t *shm_ring_slot_data(const shm_ring_slot_t *slot)
+{
+    return (const uint8_t *)slot + SHM_RING_SLOT_HEADER;
+}
+
+__attribute__((unused)) static void shm_ring_reader_close(shm_ring_reader_t *r)
+{
+    if (r->map) {
+        munmap(r->map, r->map_size);
+        r->map = NULL;
+        r->hdr = NULL;
+    }
+    if (r->sock_fd >= 0) {
+        close(r->sock_fd);
+        r->sock_fd = -1;
+    }
+}
+
+// Connects to the producer socket and maps the ring. The connection is kept
+// open for as long as the reader is, which tells the producer to keep writing.
+__attribute__((unused)) static int shm_ring_reader_open(shm_ring_reader_t *r, const char *path)
+{
+    r->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (r->sock_fd < 0) {
+        log_perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(r->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_perror("connect");
+        goto error;
+    }
+
+    uint32_t magic = 0;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &magic, sizeof(magic) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+
+    if (recvmsg(r->sock_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(magic) || magic != SHM_RING_MAGIC) {
+        log_errorf("shm_ring: bad handshake from %s\n", path);
+        goto error;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        log_errorf("shm_ring: no memfd received from %s\n", path);
+        goto error;
+    }
+
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(memfd));
+
+    struct stat st;
+    if (fstat(memfd, &st) < 0) {
+        log_perror("fstat");
+        close(memfd);
+        goto error;
+    }
+
+    r->map_size = st.st_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (r->map == MAP_FAILED) {
+        log_perror("mmap");
+        r->map = NULL;
+        goto error;
+    }
+
+    r->hdr = r->map;
+    if (r->hdr->magic != SHM_RING_MAGIC || r->hdr->version != SHM_RING_VERSION ||
+        r->hdr->num_slots == 0 ||
+        (size_t)r->hdr->data_offset + (size_t)r->hdr->num_slots * r->hdr->slot_size > r->map_size) {
+        log_errorf("shm_ring: incompatible ring from %s\n", path);
+        goto error;
+    }
+
+    r->last_seq = atomic_load_explicit(&r->hdr->write_seq, memory_order_acquire);
+    return 0;
+
+error:
+    shm_ring_reader_close(r);
+    return -1;
+}
+
+// Waits until a frame newer than the last one read is available.
+// Returns 1 if there is one, 0 on timeout, -1 on error.
+__attribute__((unused)) static int shm_ring_reader_wait(shm_ring_reader_t *r, int timeout_ms)
+{
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+
+    while (1) {
+        uint32_t futex = atomic_load_explicit(&r->hdr->futex, memory_order_acquire);
+        if (atomic_load_explicit(&r->hdr->write_seq, memory_order_acquire) > r->last_seq) {
+            return 1;
+        }
+
+        // Shared futex on a read-only mapping: FUTEX_WAIT only reads the word.
+        long ret = syscall(SYS_futex, &r->hdr->futex, FUTEX_WAIT, futex, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+        if (ret < 0 && errno == ETIMEDOUT) {
+            return 0;
+        }
+        if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+            log_perror("futex");
+            return -1;
+        }
+    }
+}
+
+// Copies the newest frame into `dst`. Frames skipped since the previous call
+// are reported in `frame->dropped`. Returns the frame size, 0 if there is no
+// new frame, or -1 if `dst` is too small.
+__attribute__((unused)) static ssize_t shm_ring_reader_read(shm_ring_reader_t *r, void *dst, size_t dst_size, shm_ring_frame_t *frame)
+{
+    while (1) {
+        uint64_t seq = atomic_load_explicit(&r->hdr->write_seq, memory_order_acquire);
+        if (seq <= r->last_seq) {
+            return 0;
+        }
+
+        shm_ring_slot_t *slot = shm_ring_slot(r->hdr, seq);
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq) {
+            continue;
+        }
+
+        shm_ring_frame_t info = {
+            .seq = seq,
+            .timestamp_us = slot->timestamp_us,
+            .fourcc = slot->fourcc,
+            .width = slot->width,
+            .height = slot->height,
+            .stride = slot->stride,
+            .size = slot->size,
+            .dropped = seq - r->last_seq - 1,
+        };
+
+        if (info.size > r->hdr->slot_size - SHM_RING_SLOT_HEADER) {
+            continue;
+        }
+        if (info.size > dst_size) {
+            return -1;
+        }
+
+        memcpy(dst, shm_ring_slot_data(slot), info.size);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        r->last_seq = seq;
+        if (frame) {
+            *frame = info;
+        }
+        return info.size;
+    }
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef SOCK_PROTO_H
+#define SOCK_PROTO_H
+
+// Messages exchanged with capture sockets, shared by capture apps and
+// consumers. All fields are little-endian host order; both ends run on the
+// same machine.
+
+#include <stdint.h>
+
+// Sent by a DMA-buf socket for every frame, with the buffer fd attached as
+// SCM_RIGHTS. The consumer owns the received fd and must close it, and
+// sends SOCK_MSG_RELEASE with `token` once it no longer reads the buffer.
+#define SOCK_DMABUF_MAGIC 0x46424d44 // "DMBF"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t token;
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t vstride;
+    uint32_t size;
+    uint64_t timestamp_us;
+} sock_dmabuf_desc_t;
+
+// Prepended to every message for clients that asked for it with
+// SOCK_MSG_HELLO / SOCK_HELLO_FRAMED. `length` payload bytes follow the
+// header; `hdr_size` allows the header to grow. Gaps in `seq` mean the
+// client missed frames. SOCK_FRAME_CACHED marks the frames since the last
+// keyframe that a just started client gets in one burst, still carrying
+// their original capture timestamps.
+#define SOCK_FRAME_MAGIC 0x4d524653 // "SFRM"
+
+enum {
+    SOCK_CODEC_NONE = 0,
+    SOCK_CODEC_JPEG = 1,
+    SOCK_CODEC_H264 = 2,
+    SOCK_CODEC_RAW = 3,
+    SOCK_CODEC_DMABUF = 4,
+    SOCK_CODEC_H265 = 5,
+};
+
+enum {
+    SOCK_FRAME_KEYFRAME = 1 << 0,
+    SOCK_FRAME_PARAM_SETS = 1 << 1,
+    SOCK_FRAME_CACHED = 1 << 2,
+};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t hdr_size;
+    uint8_t codec;
+    uint8_t flags;
+    uint32_t length;
+    uint32_t reserved;
+    uint64_t seq;
+    uint64_t timestamp_us;
+} sock_frame_header_t;
+
+// Sent by clients to the capture app. A client that wants framed output
+// sends SOCK_MSG_HELLO right after connecting; clients that stay silent get
+// bare payloads. SOCK_MSG_KEYFRAME asks the video encoder for an IDR, e.g.
+// after packet loss; requests close together are merged. SOCK_MSG_BITRATE
+// caps the video encoder at `value` kbps for as long as the client stays
+// connected; the lowest cap of all clients applies and 0 withdraws it.
+// SOCK_HELLO_PEEK is for clients that only look at the stream, e.g. for its
+// codec: they get frames as they come, without the GOP cache or a keyframe.
+enum {
+    SOCK_MSG_RELEASE = 1,
+    SOCK_MSG_HELLO = 2,
+    SOCK_MSG_KEYFRAME = 3,
+    SOCK_MSG_BITRATE = 4,
+};
+
+enum {
+    SOCK_HELLO_FRAMED = 1 << 0,
+    SOCK_HELLO_PEEK = 1 << 1,
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t value;
+} sock_msg_t;
+
+#endif
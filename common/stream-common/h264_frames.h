@@ -3,8 +3,22 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <string.h>
 
-static const uint8_t* h264_find_nal(const uint8_t* data, size_t size) {
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Start-code search: returns the first 00 00 00 01 followed by at least one
+// byte, or nullptr. The vector versions test 16 or 32 positions per step and
+// leave the last few bytes to the scalar loop, so all of them return exactly
+// what h264_find_nal_scalar() does.
+
+typedef const uint8_t* (*h264_find_nal_fn)(const uint8_t*, size_t);
+
+static const uint8_t* h264_find_nal_scalar(const uint8_t* data, size_t size) {
     for (size_t i = 0; i + 3 < size; i++) {
         if (data[i] == 0 && data[i+1] == 0 && data[i+2] == 0 && data[i+3] == 1 && size - i > 4) {
             return data + i;
@@ -13,6 +27,110 @@ static const uint8_t* h264_find_nal(const uint8_t* data, size_t size) {
     return nullptr;
 }
 
+static const uint8_t* h264_find_nal_tail(const uint8_t* data, size_t size, size_t offset) {
+    return h264_find_nal_scalar(data + offset, size - offset);
+}
+
+// A start code ends in 01, so 8 positions can be skipped when the word
+// 3 bytes further holds no 01 byte. Coded slice data rarely does.
+__attribute__((unused)) static const uint8_t* h264_find_nal_word(const uint8_t* data, size_t size) {
+    size_t i = 0;
+
+    for (; i + 12 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i + 3, sizeof(v));
+        v ^= 0x0101010101010101ULL;
+        if (((v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL) == 0) {
+            continue;
+        }
+        for (size_t j = i; j < i + 8; j++) {
+            if (data[j] == 0 && data[j+1] == 0 && data[j+2] == 0 && data[j+3] == 1) {
+                return data + j;
+            }
+        }
+    }
+
+    return h264_find_nal_tail(data, size, i);
+}
+
+#if defined(__aarch64__)
+static const uint8_t* h264_find_nal_neon(const uint8_t* data, size_t size) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i = 0;
+
+    for (; i + 20 <= size; i += 16) {
+        uint8x16_t m = vandq_u8(
+            vandq_u8(vceqq_u8(vld1q_u8(data + i), zero), vceqq_u8(vld1q_u8(data + i + 1), zero)),
+            vandq_u8(vceqq_u8(vld1q_u8(data + i + 2), zero), vceqq_u8(vld1q_u8(data + i + 3), one)));
+        // One nibble per byte, as NEON has no movemask.
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (bits) {
+            return data + i + (__builtin_ctzll(bits) >> 2);
+        }
+    }
+
+    return h264_find_nal_tail(data, size, i);
+}
+#elif defined(__SSE2__)
+static const uint8_t* h264_find_nal_sse2(const uint8_t* data, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 20 <= size; i += 16) {
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), zero),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 1)), zero)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 2)), zero),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 3)), one)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+
+    return h264_find_nal_tail(data, size, i);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t* h264_find_nal_avx2(const uint8_t* data, size_t size) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 36 <= size; i += 32) {
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), zero),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 1)), zero)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 2)), zero),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 3)), one)));
+        unsigned int mask = _mm256_movemask_epi8(m);
+        if (mask) {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+
+    return h264_find_nal_sse2(data + i, size - i);
+}
+#endif
+
+static h264_find_nal_fn h264_find_nal_select() {
+#if defined(__aarch64__)
+    return h264_find_nal_neon;
+#elif defined(__SSE2__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? h264_find_nal_avx2 : h264_find_nal_sse2;
+#else
+    return h264_find_nal_word;
+#endif
+}
+
+static const uint8_t* h264_find_nal(const uint8_t* data, size_t size) {
+    static const h264_find_nal_fn find = h264_find_nal_select();
+    return find(data, size);
+}
+
 static bool h264_is_new_frame(const uint8_t* nal, size_t nal_size) {
     if (nal_size < 5) return false;
     uint8_t nal_type = nal[4] & 0x1f;
@@ -27,38 +145,112 @@ static bool h264_is_new_frame(const uint8_t* nal, size_t nal_size) {
 static bool h264_is_aud_frame(const uint8_t* nal, size_t nal_size) {
     if (nal_size < 5) return false;
     uint8_t nal_type = nal[4] & 0x1f;
-    return nal_type == 9 && nal_size == 6 && (nal[5] & 0x80) != 0;
+    return nal_type == 9;
 }
 
-static const uint8_t *h264_process_frames(const uint8_t *data, const uint8_t *end, void (*store_frame)(const uint8_t*, size_t)) {
-    while ((end - data) >= 8) {
-        const uint8_t* start = h264_find_nal(data, end - data);
-        if (!start) {
-            if (end - data > 4) {
-                return end - 4;
-            }
-            return nullptr;
+// HEVC NAL headers are two bytes; the type sits in bits 1..6 of the first.
+static uint8_t h265_nal_type(const uint8_t* nal) {
+    return (nal[4] >> 1) & 0x3f;
+}
+
+// VCL NAL types are below 32; first_slice_segment_in_pic_flag is the first
+// bit after the NAL header.
+static bool h265_is_new_frame(const uint8_t* nal, size_t nal_size) {
+    if (nal_size < 6) return false;
+    if (h265_nal_type(nal) >= 32) return false;
+    if (nal_size < 7) return true;
+    return (nal[6] & 0x80) != 0;
+}
+
+static bool h265_is_aud_frame(const uint8_t* nal, size_t nal_size) {
+    if (nal_size < 6) return false;
+    return h265_nal_type(nal) == 35;
+}
+
+// VPS, SPS, PPS and prefix SEI.
+static bool h265_is_prefix(const uint8_t* nal, size_t nal_size) {
+    if (nal_size < 6) return false;
+    uint8_t nal_type = h265_nal_type(nal);
+    return (nal_type >= 32 && nal_type <= 34) || nal_type == 39;
+}
+
+// Tells an HEVC stream from an H264 one by the first NAL header, which the
+// encoder makes an AUD or parameter set. As H264 headers these bytes would
+// be reserved or invalid types.
+__attribute__((unused)) static bool h265_is_stream(const uint8_t* data, size_t size) {
+    const uint8_t *nal = h264_find_nal(data, size);
+    if (!nal || nal + 5 > data + size) return false;
+    return nal[4] == 0x40 || nal[4] == 0x42 || nal[4] == 0x44 || nal[4] == 0x46;
+}
+
+// Splits an Annex-B stream into access units. It resumes where the previous
+// call stopped scanning, so every byte is searched once however the input
+// is chunked. Offsets are relative to the data passed in. Set `hevc` for
+// H265 streams.
+typedef struct {
+    size_t frame;     // start of the frame being collected, SIZE_MAX before the first NAL
+    size_t scan;      // where to look for the next start code
+    bool found_slice; // the frame already has the first slice of a picture
+    bool hevc;
+} h264_splitter_t;
+
+#define H264_SPLITTER_INIT {SIZE_MAX, 0, false, false}
+
+// Passes every completed frame in data[0..size) to store_frame() and returns
+// how many leading bytes are no longer needed; the caller drops them before
+// the next call and appends new input after the rest.
+__attribute__((unused)) static size_t h264_split_frames(h264_splitter_t *sp, const uint8_t *data, size_t size, void (*store_frame)(const uint8_t*, size_t)) {
+    const uint8_t *nal;
+    size_t header_size = sp->hevc ? 7 : 6;
+
+    while ((nal = h264_find_nal(data + sp->scan, size - sp->scan)) != nullptr) {
+        size_t pos = nal - data;
+
+        // The slice header byte decides whether this starts a picture.
+        if (size - pos < header_size) {
+            sp->scan = pos;
+            break;
         }
+        sp->scan = pos + 4;
 
-        const uint8_t* next = start;
-        bool found_slice = false;
+        bool new_frame, aud, prefix;
+        if (sp->hevc) {
+            new_frame = h265_is_new_frame(nal, size - pos);
+            aud = h265_is_aud_frame(nal, size - pos);
+            prefix = h265_is_prefix(nal, size - pos);
+        } else {
+            uint8_t nal_type = nal[4] & 0x1f;
+            new_frame = h264_is_new_frame(nal, size - pos);
+            aud = h264_is_aud_frame(nal, size - pos);
+            prefix = nal_type == 6 || nal_type == 7 || nal_type == 8;
+        }
 
-        while ((next = h264_find_nal(next + 4, end - next - 4)) != nullptr) {
-            if (h264_is_aud_frame(next, end - next)) {
-                break;
-            } else if (h264_is_new_frame(next, end - next)) {
-                if (found_slice)
-                    break;
-                found_slice = true;
-            }
+        if (sp->frame == SIZE_MAX) {
+            sp->frame = pos;
+            sp->found_slice = new_frame;
+            continue;
         }
-        if (!next) {
-            return nullptr;
+
+        // After a picture, SEI and parameter sets also begin the next access
+        // unit.
+        if (!aud && !((new_frame || prefix) && sp->found_slice)) {
+            sp->found_slice |= new_frame;
+            continue;
         }
 
-        store_frame(start, next - start);
-        data = next;
+        store_frame(data + sp->frame, pos - sp->frame);
+        sp->frame = pos;
+        sp->found_slice = new_frame;
     }
 
-    return data;
+    if (!nal && size - sp->scan > 4) {
+        sp->scan = size - 4;
+    }
+
+    size_t consumed = sp->frame == SIZE_MAX ? sp->scan : sp->frame;
+    if (sp->frame != SIZE_MAX) {
+        sp->frame -= consumed;
+    }
+    sp->scan -= consumed;
+    return consumed;
 }
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <vector>
+
+#include "h264_frames.h"
+
+// RTP packetization of one Annex-B access unit (RFC 6184 for H264, RFC 7798
+// for H265): NALs that fit go out as single NAL packets, larger ones as
+// FU-A / FU fragments, and the last packet carries the marker bit. AUDs are
+// left out. The packets are built once per frame with sequence number,
+// timestamp and SSRC left zero; h264_rtp_stamp() fills those in for each
+// receiver right before sending.
+
+#define H264_RTP_HEADER_SIZE 12
+#define H264_RTP_MAX_PAYLOAD 1200
+
+typedef struct {
+    size_t offset;
+    size_t size;
+} h264_rtp_packet_t;
+
+// Reused across frames, so steady-state packetization does not allocate.
+// `keyframe` is set when the frame holds an IDR/IRAP slice.
+typedef struct {
+    std::vector<uint8_t> buf;
+    std::vector<h264_rtp_packet_t> packets;
+    bool keyframe;
+} h264_rtp_frame_t;
+
+static uint8_t *h264_rtp_add_packet(h264_rtp_frame_t *frame, uint8_t payload_type, size_t payload_size) {
+    size_t offset = frame->buf.size();
+
+    frame->buf.resize(offset + H264_RTP_HEADER_SIZE + payload_size);
+    frame->packets.push_back({offset, H264_RTP_HEADER_SIZE + payload_size});
+
+    uint8_t *pkt = frame->buf.data() + offset;
+    memset(pkt, 0, H264_RTP_HEADER_SIZE);
+    pkt[0] = 0x80; // version 2
+    pkt[1] = payload_type;
+    return pkt + H264_RTP_HEADER_SIZE;
+}
+
+// `nal` is the NAL unit without start code.
+static void h264_rtp_add_nal(h264_rtp_frame_t *frame, uint8_t payload_type, bool hevc, const uint8_t *nal, size_t size) {
+    size_t hdr_size = hevc ? 2 : 1;
+
+    if (size <= H264_RTP_MAX_PAYLOAD) {
+        memcpy(h264_rtp_add_packet(frame, payload_type, size), nal, size);
+        return;
+    }
+
+    // The fragments carry the NAL header in the FU indicator/header instead.
+    size_t fu_size = hdr_size + 1;
+    size_t max_chunk = H264_RTP_MAX_PAYLOAD - fu_size;
+    const uint8_t *data = nal + hdr_size;
+    size_t remaining = size - hdr_size;
+    bool first = true;
+
+    while (remaining > 0) {
+        size_t chunk = remaining < max_chunk ? remaining : max_chunk;
+        uint8_t *payload = h264_rtp_add_packet(frame, payload_type, fu_size + chunk);
+        uint8_t se = (first ? 0x80 : 0) | (chunk == remaining ? 0x40 : 0);
+
+        if (hevc) {
+            payload[0] = (nal[0] & 0x81) | (49 << 1);
+            payload[1] = nal[1];
+            payload[2] = se | ((nal[0] >> 1) & 0x3f);
+        } else {
+            payload[0] = (nal[0] & 0xe0) | 28;
+            payload[1] = se | (nal[0] & 0x1f);
+        }
+        memcpy(payload + fu_size, data, chunk);
+
+        data += chunk;
+        remaining -= chunk;
+        first = false;
+    }
+}
+
+__attribute__((unused)) static void h264_rtp_packetize(h264_rtp_frame_t *frame, uint8_t payload_type, bool hevc, const uint8_t *data, size_t size) {
+    frame->buf.clear();
+    frame->packets.clear();
+    frame->keyframe = false;
+
+    const uint8_t *nal = h264_find_nal(data, size);
+    while (nal) {
+        const uint8_t *next = h264_find_nal(nal + 4, data + size - nal - 4);
+        size_t nal_size = (next ? next : data + size) - nal;
+        bool aud = hevc ? h265_is_aud_frame(nal, nal_size) : h264_is_aud_frame(nal, nal_size);
+
+        if (!aud && nal_size > 4 + (hevc ? 2 : 1)) {
+            uint8_t type = hevc ? h265_nal_type(nal) : nal[4] & 0x1f;
+            frame->keyframe |= hevc ? type >= 16 && type <= 21 : type == 5;
+            h264_rtp_add_nal(frame, payload_type, hevc, nal + 4, nal_size - 4);
+        }
+        nal = next;
+    }
+
+    if (!frame->packets.empty()) {
+        frame->buf[frame->packets.back().offset + 1] |= 0x80; // marker
+    }
+}
+
+__attribute__((unused)) static void h264_rtp_stamp(uint8_t *pkt, uint16_t seq, uint32_t timestamp, uint32_t ssrc) {
+    pkt[2] = seq >> 8;
+    pkt[3] = seq;
+    pkt[4] = timestamp >> 24;
+    pkt[5] = timestamp >> 16;
+    pkt[6] = timestamp >> 8;
+    pkt[7] = timestamp;
+    pkt[8] = ssrc >> 24;
+    pkt[9] = ssrc >> 16;
+    pkt[10] = ssrc >> 8;
+    pkt[11] = ssrc;
+}
+
+// Fraction lost (out of 256) from the last report block about `ssrc` in a
+// compound RTCP packet (RFC 3550 SR/RR), or -1 when there is none.
+__attribute__((unused)) static int h264_rtcp_fraction_lost(const uint8_t *data, size_t size, uint32_t ssrc) {
+    int fraction = -1;
+
+    while (size >= 8) {
+        size_t len = (((size_t)data[2] << 8) | data[3]) * 4 + 4;
+        if (len > size) {
+            break;
+        }
+
+        size_t block = data[1] == 200 ? 28 : data[1] == 201 ? 8 : len; // SR, RR
+        for (int n = data[0] & 0x1f; n > 0 && block + 24 <= len; n--, block += 24) {
+            const uint8_t *b = data + block;
+            if (((uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]) == ssrc) {
+                fraction = b[4];
+            }
+        }
+
+        data += len;
+        size -= len;
+    }
+    return fraction;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Reads profile, level and picture size from an H264 or H265 SPS. `nal` is
+// the NAL unit without start code, emulation prevention bytes included.
+
+typedef struct {
+    int profile;
+    int level;
+    int width;
+    int height;
+} h264_sps_info_t;
+
+// Bit reader over the RBSP, i.e. with emulation prevention bytes removed.
+// Reads past the end return zeros and set `overrun`.
+typedef struct {
+    uint8_t data[256];
+    size_t size;
+    size_t pos;
+    bool overrun;
+} h264_bits_t;
+
+static void h264_bits_init(h264_bits_t *b, const uint8_t *nal, size_t size) {
+    size_t zeros = 0;
+
+    b->size = 0;
+    b->pos = 0;
+    b->overrun = false;
+
+    for (size_t i = 0; i < size && b->size < sizeof(b->data); i++) {
+        if (zeros >= 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] == 0 ? zeros + 1 : 0;
+        b->data[b->size++] = nal[i];
+    }
+}
+
+static uint32_t h264_bits_read(h264_bits_t *b, int n) {
+    uint32_t v = 0;
+
+    for (int i = 0; i < n; i++, b->pos++) {
+        if (b->pos >= b->size * 8) {
+            b->overrun = true;
+            v <<= 1;
+            continue;
+        }
+        v = (v << 1) | ((b->data[b->pos / 8] >> (7 - b->pos % 8)) & 1);
+    }
+    return v;
+}
+
+static void h264_bits_skip(h264_bits_t *b, size_t n) {
+    b->pos += n;
+    if (b->pos > b->size * 8) {
+        b->overrun = true;
+    }
+}
+
+static uint32_t h264_bits_read_ue(h264_bits_t *b) {
+    int zeros = 0;
+
+    while (h264_bits_read(b, 1) == 0) {
+        if (b->overrun || ++zeros > 31) {
+            b->overrun = true;
+            return 0;
+        }
+    }
+    return ((1u << zeros) - 1) + h264_bits_read(b, zeros);
+}
+
+static int32_t h264_bits_read_se(h264_bits_t *b) {
+    uint32_t v = h264_bits_read_ue(b);
+    return v & 1 ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+}
+
+static void h264_skip_scaling_list(h264_bits_t *b, int size) {
+    int last = 8, next = 8;
+
+    for (int i = 0; i < size && !b->overrun; i++) {
+        if (next != 0) {
+            next = (last + h264_bits_read_se(b) + 256) % 256;
+        }
+        last = next == 0 ? last : next;
+    }
+}
+
+__attribute__((unused)) static bool h264_parse_sps(const uint8_t *nal, size_t size, h264_sps_info_t *info) {
+    h264_bits_t b;
+    h264_bits_init(&b, nal, size);
+
+    h264_bits_skip(&b, 8); // NAL header
+    info->profile = h264_bits_read(&b, 8);
+    h264_bits_skip(&b, 8); // constraint flags
+    info->level = h264_bits_read(&b, 8);
+    h264_bits_read_ue(&b); // seq_parameter_set_id
+
+    uint32_t chroma_format_idc = 1;
+    switch (info->profile) {
+    case 100: case 110: case 122: case 244: case 44:
+    case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+        chroma_format_idc = h264_bits_read_ue(&b);
+        if (chroma_format_idc == 3) {
+            h264_bits_skip(&b, 1); // separate_colour_plane_flag
+        }
+        h264_bits_read_ue(&b); // bit_depth_luma_minus8
+        h264_bits_read_ue(&b); // bit_depth_chroma_minus8
+        h264_bits_skip(&b, 1); // qpprime_y_zero_transform_bypass_flag
+        if (h264_bits_read(&b, 1)) {
+            for (int i = 0; i < (chroma_format_idc != 3 ? 8 : 12); i++) {
+                if (h264_bits_read(&b, 1)) {
+                    h264_skip_scaling_list(&b, i < 6 ? 16 : 64);
+                }
+            }
+        }
+        break;
+    }
+
+    h264_bits_read_ue(&b); // log2_max_frame_num_minus4
+    uint32_t poc_type = h264_bits_read_ue(&b);
+    if (poc_type == 0) {
+        h264_bits_read_ue(&b); // log2_max_pic_order_cnt_lsb_minus4
+    } else if (poc_type == 1) {
+        h264_bits_skip(&b, 1);
+        h264_bits_read_se(&b);
+        h264_bits_read_se(&b);
+        uint32_t cycle = h264_bits_read_ue(&b);
+        for (uint32_t i = 0; i < cycle && !b.overrun; i++) {
+            h264_bits_read_se(&b);
+        }
+    }
+
+    h264_bits_read_ue(&b); // max_num_ref_frames
+    h264_bits_skip(&b, 1); // gaps_in_frame_num_value_allowed_flag
+    uint32_t width_mbs = h264_bits_read_ue(&b) + 1;
+    uint32_t height_units = h264_bits_read_ue(&b) + 1;
+    uint32_t frame_mbs_only = h264_bits_read(&b, 1);
+    if (!frame_mbs_only) {
+        h264_bits_skip(&b, 1); // mb_adaptive_frame_field_flag
+    }
+    h264_bits_skip(&b, 1); // direct_8x8_inference_flag
+
+    uint32_t crop[4] = {0};
+    if (h264_bits_read(&b, 1)) {
+        for (int i = 0; i < 4; i++) {
+            crop[i] = h264_bits_read_ue(&b);
+        }
+    }
+
+    uint32_t crop_x = chroma_format_idc == 1 || chroma_format_idc == 2 ? 2 : 1;
+    uint32_t crop_y = (chroma_format_idc == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    info->width = width_mbs * 16 - crop_x * (crop[0] + crop[1]);
+    info->height = (2 - frame_mbs_only) * height_units * 16 - crop_y * (crop[2] + crop[3]);
+    return !b.overrun;
+}
+
+__attribute__((unused)) static bool h265_parse_sps(const uint8_t *nal, size_t size, h264_sps_info_t *info) {
+    h264_bits_t b;
+    h264_bits_init(&b, nal, size);
+
+    h264_bits_skip(&b, 16); // NAL header
+    h264_bits_skip(&b, 4);  // sps_video_parameter_set_id
+    uint32_t max_sub_layers = h264_bits_read(&b, 3) + 1;
+    h264_bits_skip(&b, 1);  // sps_temporal_id_nesting_flag
+
+    // profile_tier_level()
+    h264_bits_skip(&b, 3);  // general_profile_space, general_tier_flag
+    info->profile = h264_bits_read(&b, 5);
+    h264_bits_skip(&b, 32 + 48);
+    info->level = h264_bits_read(&b, 8);
+
+    bool profile_present[8] = {0}, level_present[8] = {0};
+    for (uint32_t i = 0; i < max_sub_layers - 1; i++) {
+        profile_present[i] = h264_bits_read(&b, 1);
+        level_present[i] = h264_bits_read(&b, 1);
+    }
+    if (max_sub_layers > 1) {
+        h264_bits_skip(&b, 2 * (8 - (max_sub_layers - 1)));
+    }
+    for (uint32_t i = 0; i < max_sub_layers - 1; i++) {
+        h264_bits_skip(&b, (profile_present[i] ? 88 : 0) + (level_present[i] ? 8 : 0));
+    }
+
+    h264_bits_read_ue(&b); // sps_seq_parameter_set_id
+    uint32_t chroma_format_idc = h264_bits_read_ue(&b);
+    if (chroma_format_idc == 3) {
+        h264_bits_skip(&b, 1); // separate_colour_plane_flag
+    }
+    uint32_t width = h264_bits_read_ue(&b);
+    uint32_t height = h264_bits_read_ue(&b);
+
+    uint32_t crop[4] = {0};
+    if (h264_bits_read(&b, 1)) {
+        for (int i = 0; i < 4; i++) {
+            crop[i] = h264_bits_read_ue(&b);
+        }
+    }
+
+    uint32_t crop_x = chroma_format_idc == 1 || chroma_format_idc == 2 ? 2 : 1;
+    uint32_t crop_y = chroma_format_idc == 1 ? 2 : 1;
+    info->width = width - crop_x * (crop[0] + crop[1]);
+    info->height = height - crop_y * (crop[2] + crop[3]);
+    return !b.overrun;
+}
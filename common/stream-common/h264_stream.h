@@ -1,25 +1,64 @@
 #pragma once
 
 #include "log.h"
+#include "sock_proto.h"
 
 static constexpr int MIN_FRAME_SIZE = 64 * 1024;
 static constexpr int MAX_FRAME_SIZE = 2 * 1024 * 1024;
 
+// A catch-up burst from the capture app's GOP cache is played this many
+// times faster than it was captured.
+static constexpr uint64_t CATCHUP_SPEEDUP = 16;
+static constexpr uint64_t MIN_PTS_STEP_US = 1000;
+
+static constexpr int PROBE_TIMEOUT_MS = 2000;
+static constexpr int PROBE_RETRY_MS = 1000;
+static constexpr int PROBE_MAX_RETRY_MS = 30000;
+
+// The capture app sends framed output (sock_frame_header_t before every
+// frame) after our hello, and bare Annex-B from versions that predate it;
+// the first bytes read tell which, and also whether the stream is H264 or
+// H265 (`codec`). Header fields of the frame being stored are kept here for
+// store_frame(), along with its presentation time `pts_us`.
+//
+// Input is appended at `size` and consumed from `head`.
 typedef struct {
     int fd;
     std::vector<uint8_t> buf;
+    size_t head;
     size_t size;
+    h264_splitter_t splitter;
+    bool detected;
+    bool framed;
+    uint8_t codec;
+    uint64_t seq;
+    uint64_t dropped;
+    uint64_t timestamp_us;
+    uint8_t flags;
+    uint64_t pts_us;
+    uint64_t catchup_us;
 } h264_stream_t;
 
-#define H264_STREAM_INIT {.fd = -1, .buf = std::vector<uint8_t>(), .size = 0}
+#define H264_STREAM_INIT {.fd = -1, .buf = std::vector<uint8_t>(), .head = 0, .size = 0, .splitter = H264_SPLITTER_INIT, \
+    .detected = false, .framed = false, .codec = SOCK_CODEC_NONE, .seq = 0, .dropped = 0, .timestamp_us = 0, .flags = 0, \
+    .pts_us = 0, .catchup_us = 0}
 
-static bool h264_stream_open(h264_stream_t *stream, const char *path) {
+// `hello` is the SOCK_HELLO_* flags sent to the capture app.
+static bool h264_stream_connect(h264_stream_t *stream, const char *path, uint32_t hello) {
     if (stream->fd >= 0) {
         return false;
     }
 
+    stream->head = 0;
     stream->size = 0;
-    stream->buf.resize(0);
+    stream->buf.resize(MAX_FRAME_SIZE + MIN_FRAME_SIZE);
+    stream->splitter = H264_SPLITTER_INIT;
+    stream->detected = false;
+    stream->framed = false;
+    stream->codec = SOCK_CODEC_NONE;
+    stream->seq = 0;
+    stream->dropped = 0;
+    stream->catchup_us = 0;
 
     stream->fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (stream->fd < 0) {
@@ -39,10 +78,22 @@ static bool h264_stream_open(h264_stream_t *stream, const char *path) {
         return false;
     }
 
+    sock_msg_t msg = { SOCK_MSG_HELLO, hello };
+    if (write(stream->fd, &msg, sizeof(msg)) != sizeof(msg)) {
+        log_perror("write");
+        close(stream->fd);
+        stream->fd = -1;
+        return false;
+    }
+
     log_errorf("Connected to H264 socket\n");
     return true;
 }
 
+static bool h264_stream_open(h264_stream_t *stream, const char *path) {
+    return h264_stream_connect(stream, path, SOCK_HELLO_FRAMED);
+}
+
 static bool h264_stream_close(h264_stream_t *stream) {
     if (stream->fd < 0) {
         return false;
@@ -51,21 +102,151 @@ static bool h264_stream_close(h264_stream_t *stream) {
     close(stream->fd);
     stream->fd = -1;
     stream->buf.clear();
+    stream->buf.shrink_to_fit();
+    stream->head = 0;
     stream->size = 0;
     log_errorf("Disconnected from H264 socket\n");
     return true;
 }
 
+// Asks the capture app for an IDR. It merges requests that come in quick
+// succession, so callers need not rate-limit.
+static void h264_stream_request_keyframe(h264_stream_t *stream) {
+    if (stream->fd < 0) {
+        return;
+    }
+
+    sock_msg_t msg = { SOCK_MSG_KEYFRAME, 0 };
+    if (send(stream->fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN) {
+        log_perror("send");
+    }
+}
+
+// Caps the encoder bitrate while this connection stays open; 0 lifts the
+// cap. The capture app forgets it on reconnect.
+__attribute__((unused)) static void h264_stream_request_bitrate(h264_stream_t *stream, uint32_t kbps) {
+    if (stream->fd < 0) {
+        return;
+    }
+
+    sock_msg_t msg = { SOCK_MSG_BITRATE, kbps };
+    if (send(stream->fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN) {
+        log_perror("send");
+    }
+}
+
+static uint64_t h264_stream_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// Capture time of the frame being stored, in CLOCK_MONOTONIC microseconds
+// like the V4L2 timestamps the capture apps send. Unframed streams carry no
+// timestamp, so the current time stands in.
+static uint64_t h264_stream_capture_time_us(const h264_stream_t *stream) {
+    if (stream->framed && stream->timestamp_us) {
+        return stream->timestamp_us;
+    }
+    return h264_stream_now_us();
+}
+
+// When to play the frame being stored, on the same clock. This is the
+// capture time, except for a catch-up burst: played at capture pace it
+// would keep the viewer behind by the age of the cached GOP, so its times
+// are squeezed towards the arrival of the burst. Never goes backwards.
+static void h264_stream_update_pts(h264_stream_t *stream) {
+    uint64_t pts = h264_stream_capture_time_us(stream);
+
+    if (stream->framed && (stream->flags & SOCK_FRAME_CACHED)) {
+        if (!stream->catchup_us) {
+            stream->catchup_us = h264_stream_now_us();
+        }
+        if (pts < stream->catchup_us) {
+            pts = stream->catchup_us - (stream->catchup_us - pts) / CATCHUP_SPEEDUP;
+        }
+    } else {
+        stream->catchup_us = 0;
+    }
+
+    if (stream->pts_us && pts < stream->pts_us + MIN_PTS_STEP_US) {
+        pts = stream->pts_us + MIN_PTS_STEP_US;
+    }
+    stream->pts_us = pts;
+}
+
+// Presentation time of the frame being stored. Unframed streams play
+// frames as they arrive.
+static uint64_t h264_stream_pts_us(const h264_stream_t *stream) {
+    if (stream->framed && stream->pts_us) {
+        return stream->pts_us;
+    }
+    return h264_stream_now_us();
+}
+
+// The presentation time on the wall clock, which RTP stacks pair with the
+// RTCP sender report NTP time.
+__attribute__((unused)) static struct timeval h264_stream_pts_timeval(const h264_stream_t *stream) {
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    int64_t offset_us = (int64_t)(real.tv_sec - mono.tv_sec) * 1000000 + (real.tv_nsec - mono.tv_nsec) / 1000;
+    uint64_t us = h264_stream_pts_us(stream) + offset_us;
+    struct timeval tv = { (time_t)(us / 1000000), (suseconds_t)(us % 1000000) };
+    return tv;
+}
+
+// Returns how many bytes of complete frames were passed on, or SIZE_MAX on a
+// bad header.
+static size_t h264_stream_split_framed(h264_stream_t *stream, const uint8_t *data, size_t size, void (*store_frame)(const uint8_t*, size_t)) {
+    size_t offset = 0;
+
+    while (size - offset >= sizeof(sock_frame_header_t)) {
+        sock_frame_header_t hdr;
+        memcpy(&hdr, data + offset, sizeof(hdr));
+
+        if (hdr.magic != SOCK_FRAME_MAGIC || hdr.hdr_size < sizeof(hdr) ||
+            (size_t)hdr.hdr_size + hdr.length > MAX_FRAME_SIZE) {
+            return SIZE_MAX;
+        }
+        if (size - offset < (size_t)hdr.hdr_size + hdr.length) {
+            break;
+        }
+
+        if (stream->seq && hdr.seq > stream->seq + 1) {
+            stream->dropped += hdr.seq - stream->seq - 1;
+        }
+        stream->seq = hdr.seq;
+        stream->codec = hdr.codec;
+        stream->timestamp_us = hdr.timestamp_us;
+        stream->flags = hdr.flags;
+        h264_stream_update_pts(stream);
+
+        store_frame(data + offset + hdr.hdr_size, hdr.length);
+        offset += hdr.hdr_size + hdr.length;
+    }
+
+    return offset;
+}
+
 static ssize_t h264_stream_process(h264_stream_t *stream, void (*store_frame)(const uint8_t*, size_t)) {
     if (stream->fd < 0) {
         return -1;
     }
 
-    if (stream->size >= MAX_FRAME_SIZE) {
-        log_errorf("Buffer overflow, resetting buffer\n");
-        stream->size = 0;
-    } else if (stream->size + MIN_FRAME_SIZE / 2 > stream->buf.size()) {
-        stream->buf.resize(stream->size + MIN_FRAME_SIZE);
+    if (stream->buf.size() - stream->size < MIN_FRAME_SIZE / 2) {
+        size_t pending = stream->size - stream->head;
+        if (pending >= MAX_FRAME_SIZE) {
+            log_errorf("Buffer overflow, resetting buffer\n");
+            pending = 0;
+            stream->splitter = H264_SPLITTER_INIT;
+            stream->splitter.hevc = stream->codec == SOCK_CODEC_H265;
+        } else {
+            memmove(stream->buf.data(), stream->buf.data() + stream->head, pending);
+        }
+        stream->head = 0;
+        stream->size = pending;
     }
 
     ssize_t n = read(stream->fd, stream->buf.data() + stream->size, stream->buf.size() - stream->size);
@@ -88,21 +269,102 @@ static ssize_t h264_stream_process(h264_stream_t *stream, void (*store_frame)(co
 
     stream->size += n;
 
-    const uint8_t* processed = h264_process_frames(stream->buf.data(), stream->buf.data() + stream->size, store_frame);
-    if (!processed) {
-      return 0;
+    const uint8_t *data = stream->buf.data() + stream->head;
+    size_t size = stream->size - stream->head;
+
+    if (!stream->detected) {
+        uint32_t magic;
+        if (size < sizeof(magic)) {
+            return 0;
+        }
+        memcpy(&magic, data, sizeof(magic));
+        stream->framed = magic == SOCK_FRAME_MAGIC;
+        if (!stream->framed) {
+            if (size < 5) {
+                return 0;
+            }
+            stream->codec = h265_is_stream(data, size) ? SOCK_CODEC_H265 : SOCK_CODEC_H264;
+            stream->splitter.hevc = stream->codec == SOCK_CODEC_H265;
+        }
+        stream->detected = true;
     }
 
-    size_t size = processed - stream->buf.data();
-    size_t remaining = stream->size - size;
-    if (remaining > 0) {
-        memmove(stream->buf.data(), processed, remaining);
+    size_t consumed;
+    if (stream->framed) {
+        consumed = h264_stream_split_framed(stream, data, size, store_frame);
+        if (consumed == SIZE_MAX) {
+            log_errorf("Bad frame header on H264 socket\n");
+            close(stream->fd);
+            stream->fd = -1;
+            return -1;
+        }
+    } else {
+        consumed = h264_split_frames(&stream->splitter, data, size, store_frame);
+    }
+
+    // Move the unconsumed rest to the front once it is no longer than what
+    // was consumed before it, so each byte is moved at most about once and
+    // reads land in the same, cache-warm part of the buffer.
+    stream->head += consumed;
+    size_t pending = stream->size - stream->head;
+    if (stream->head > 0 && pending <= stream->head) {
+        memmove(stream->buf.data(), stream->buf.data() + stream->head, pending);
+        stream->head = 0;
+        stream->size = pending;
+    }
+
+    return consumed;
+}
+
+// Connects just long enough to read the first frame and returns its codec,
+// SOCK_CODEC_H264 or SOCK_CODEC_H265, or SOCK_CODEC_NONE if nothing arrives
+// in time. Peeking leaves the GOP cache and the encoder alone.
+static uint8_t h264_stream_probe_codec(const char *path, int timeout_ms) {
+    h264_stream_t probe = H264_STREAM_INIT;
+    uint8_t codec = SOCK_CODEC_NONE;
+
+    if (!h264_stream_connect(&probe, path, SOCK_HELLO_FRAMED | SOCK_HELLO_PEEK)) {
+        return codec;
     }
-    stream->size = remaining;
 
-    if (stream->buf.size() > MIN_FRAME_SIZE) {
-        stream->buf.resize(remaining + MIN_FRAME_SIZE);
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (probe.codec == SOCK_CODEC_NONE) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000L + (now.tv_nsec - start.tv_nsec) / 1000000L;
+        struct pollfd pfd = { probe.fd, POLLIN, 0 };
+        if (elapsed_ms >= timeout_ms || poll(&pfd, 1, timeout_ms - elapsed_ms) <= 0) {
+            log_errorf("No frame from %s\n", path);
+            break;
+        }
+        if (h264_stream_process(&probe, [](const uint8_t*, size_t) {}) < 0) {
+            break;
+        }
     }
+    if (probe.codec == SOCK_CODEC_H264 || probe.codec == SOCK_CODEC_H265) {
+        codec = probe.codec;
+    }
+
+    h264_stream_close(&probe);
+    return codec;
+}
+
+// Probes on a thread of its own until the codec is known and stores it in
+// `codec` unless something else did first, so the caller's event loop never
+// waits for the socket. Retries back off while the capture app is down; the
+// thread shares `codec` so it may outlive the caller.
+__attribute__((unused)) static void h264_stream_probe_codec_async(const std::string &path, std::shared_ptr<std::atomic<uint8_t>> codec) {
+    std::thread([path, codec]() {
+        int delay_ms = PROBE_RETRY_MS;
+        uint8_t probed;
+
+        while ((probed = h264_stream_probe_codec(path.c_str(), PROBE_TIMEOUT_MS)) == SOCK_CODEC_NONE) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+            delay_ms = std::min(delay_ms * 2, PROBE_MAX_RETRY_MS);
+        }
 
-    return size;
+        uint8_t none = SOCK_CODEC_NONE;
+        codec->compare_exchange_strong(none, probed);
+    }).detach();
 }
@@ -0,0 +1,168 @@
+// Frame fan-out latency in stream-webrtc with busy signaling threads: the
+// client list behind one mutex against the atomically swapped snapshot
+// (ClientList, clients_snapshot() and update_clients() as in
+// apps/stream-webrtc/main.cpp). Background threads stand in for signaling
+// and libdatachannel callbacks: each walks the list doing some work per
+// client, and every fourth one also adds and removes a client.
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define BENCH_CLIENTS 4
+#define BENCH_FRAMES 3000
+#define FRAME_INTERVAL_US 200
+#define BACKGROUND_INTERVAL_US 50
+#define SEND_WORK 500
+#define LOOKUP_WORK 20000
+
+using clock_type = std::chrono::steady_clock;
+
+struct Client {
+    int id;
+    std::atomic<uint64_t> frames_sent{0};
+};
+
+static std::atomic<bool> g_stop;
+
+static void busy_work(int n) {
+    volatile int x = 0;
+    for (int i = 0; i < n; i++) {
+        x = x + i;
+    }
+}
+
+// The list as a single mutex protects it: every reader holds the lock for
+// its whole walk.
+struct MutexClients {
+    std::mutex lock;
+    std::list<std::shared_ptr<Client>> list;
+
+    void add(std::shared_ptr<Client> client) {
+        std::lock_guard<std::mutex> lk(lock);
+        list.push_back(client);
+    }
+
+    template <typename F>
+    void for_each(F f) {
+        std::lock_guard<std::mutex> lk(lock);
+        for (auto &c : list) {
+            f(*c);
+        }
+    }
+
+    void churn(int id) {
+        std::lock_guard<std::mutex> lk(lock);
+        auto c = std::make_shared<Client>();
+        c->id = id;
+        list.push_back(c);
+        list.remove_if([id](const auto &x) { return x->id == id; });
+    }
+};
+
+// Readers take a reference to the current list and never wait; writers
+// copy, modify and publish under the mutex.
+struct SnapshotClients {
+    using ClientList = std::vector<std::shared_ptr<Client>>;
+
+    std::mutex lock;
+    std::shared_ptr<const ClientList> clients = std::make_shared<const ClientList>();
+
+    std::shared_ptr<const ClientList> snapshot() {
+        return std::atomic_load(&clients);
+    }
+
+    template <typename F>
+    void update(F f) {
+        std::lock_guard<std::mutex> lk(lock);
+        auto copy = std::make_shared<ClientList>(*clients);
+        f(*copy);
+        std::atomic_store(&clients, std::shared_ptr<const ClientList>(std::move(copy)));
+    }
+
+    void add(std::shared_ptr<Client> client) {
+        update([&](ClientList &list) { list.push_back(client); });
+    }
+
+    template <typename F>
+    void for_each(F f) {
+        auto list = snapshot();
+        for (auto &c : *list) {
+            f(*c);
+        }
+    }
+
+    void churn(int id) {
+        auto c = std::make_shared<Client>();
+        c->id = id;
+        update([&](ClientList &list) { list.push_back(c); });
+        update([id](ClientList &list) {
+            list.erase(std::remove_if(list.begin(), list.end(), [id](const auto &x) { return x->id == id; }), list.end());
+        });
+    }
+};
+
+template <typename Clients>
+static void background(Clients *clients, int id) {
+    while (!g_stop) {
+        clients->for_each([id](Client &c) {
+            if (c.id == id) {
+                busy_work(LOOKUP_WORK);
+            }
+        });
+        if (id % 4 == 0) {
+            clients->churn(1000 + id);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(BACKGROUND_INTERVAL_US));
+    }
+}
+
+template <typename Clients>
+static void run(const char *name, int threads) {
+    Clients clients;
+    for (int i = 0; i < BENCH_CLIENTS; i++) {
+        auto c = std::make_shared<Client>();
+        c->id = i;
+        clients.add(c);
+    }
+
+    g_stop = false;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(background<Clients>, &clients, i);
+    }
+
+    std::vector<double> latency_us;
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        auto start = clock_type::now();
+        clients.for_each([](Client &c) {
+            busy_work(SEND_WORK);
+            c.frames_sent++;
+        });
+        latency_us.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - start).count());
+        std::this_thread::sleep_for(std::chrono::microseconds(FRAME_INTERVAL_US));
+    }
+
+    g_stop = true;
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    std::sort(latency_us.begin(), latency_us.end());
+    printf("%-8s background %2d  p50 %7.1f us  p99 %7.1f us  max %8.1f us\n", name, threads,
+           latency_us[latency_us.size() / 2], latency_us[latency_us.size() * 99 / 100], latency_us.back());
+}
+
+int main() {
+    for (int threads : {0, 2, 8, 32}) {
+        run<MutexClients>("mutex", threads);
+        run<SnapshotClients>("snapshot", threads);
+    }
+    return 0;
+}
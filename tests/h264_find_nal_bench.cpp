@@ -0,0 +1,153 @@
+// Start code search throughput: each h264_find_nal variant against the
+// scalar reference on synthetic Annex-B streams of 2, 4 and 8 Mbps at 30 fps.
+// Before timing, every variant is checked against the scalar search on short
+// buffers full of zeros and ones, at every offset.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "h264_frames.h"
+
+#define BENCH_FPS 30
+#define BENCH_FRAMES 300
+#define BENCH_GOP 60
+#define BENCH_SECONDS 0.3
+#define CHECK_ROUNDS 200000
+#define CHECK_MAX_SIZE 80
+
+struct find_nal_impl {
+    const char *name;
+    h264_find_nal_fn find;
+};
+
+static std::vector<find_nal_impl> impls;
+
+// Keeps the timed searches from being optimized out.
+static volatile size_t nals_found;
+
+// The scalar reference comes first; the others are compared against it.
+static void find_impls() {
+    impls.push_back({"scalar", h264_find_nal_scalar});
+    impls.push_back({"word", h264_find_nal_word});
+#if defined(__aarch64__)
+    impls.push_back({"neon", h264_find_nal_neon});
+#elif defined(__SSE2__)
+    impls.push_back({"sse2", h264_find_nal_sse2});
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impls.push_back({"avx2", h264_find_nal_avx2});
+    }
+#endif
+    impls.push_back({"selected", h264_find_nal});
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void append(std::vector<uint8_t> &v, std::initializer_list<uint8_t> bytes) {
+    v.insert(v.end(), bytes);
+}
+
+// AUD, SPS/PPS and IDR every BENCH_GOP frames, P slices in between. Slice
+// payloads are random bytes with emulation prevention applied, so the only
+// start codes are the real ones; sizes vary around the bitrate's average.
+static std::vector<uint8_t> make_stream(int kbps) {
+    std::vector<uint8_t> v;
+    size_t average = (size_t)kbps * 1000 / 8 / BENCH_FPS;
+
+    srand(kbps);
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        bool idr = f % BENCH_GOP == 0;
+
+        append(v, {0, 0, 0, 1, 0x09, 0xf0});
+        if (idr) {
+            append(v, {0, 0, 0, 1, 0x67, 0x64, 0x00, 0x29});
+            append(v, {0, 0, 0, 1, 0x68, 0xee});
+        }
+        append(v, {0, 0, 0, 1, (uint8_t)(idr ? 0x65 : 0x41), 0x88});
+
+        size_t size = average / 2 + rand() % average;
+        int zeros = 0;
+        for (size_t n = 0; n < size; n++) {
+            uint8_t b = rand();
+            if (zeros >= 2 && b <= 3) {
+                v.push_back(3);
+                zeros = 0;
+            }
+            v.push_back(b);
+            zeros = b == 0 ? zeros + 1 : 0;
+        }
+    }
+    return v;
+}
+
+static size_t count_nals(h264_find_nal_fn find, const std::vector<uint8_t> &v) {
+    const uint8_t *p = v.data();
+    const uint8_t *end = p + v.size();
+    size_t count = 0;
+
+    while ((p = find(p, end - p)) != nullptr) {
+        count++;
+        p += 4;
+    }
+    return count;
+}
+
+static bool check_exact() {
+    std::vector<uint8_t> buf(CHECK_MAX_SIZE);
+
+    srand(1);
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        size_t size = rand() % CHECK_MAX_SIZE;
+        for (size_t n = 0; n < size; n++) {
+            int r = rand() % 4;
+            buf[n] = r < 2 ? 0 : r == 2 ? 1 : rand();
+        }
+
+        for (size_t offset = 0; offset <= size; offset++) {
+            const uint8_t *expected = h264_find_nal_scalar(buf.data() + offset, size - offset);
+            for (const auto &impl : impls) {
+                if (impl.find(buf.data() + offset, size - offset) != expected) {
+                    fprintf(stderr, "%s: wrong result, size %zu offset %zu\n", impl.name, size, offset);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    find_impls();
+    if (!check_exact()) {
+        return 1;
+    }
+
+    for (int kbps : {2000, 4000, 8000}) {
+        std::vector<uint8_t> stream = make_stream(kbps);
+        double scalar_mbs = 0;
+
+        printf("%d kbps, %zu bytes, %zu NALs\n", kbps, stream.size(), count_nals(h264_find_nal_scalar, stream));
+        for (const auto &impl : impls) {
+            double start = now_s(), elapsed;
+            int iterations = 0;
+            do {
+                nals_found = count_nals(impl.find, stream);
+                iterations++;
+                elapsed = now_s() - start;
+            } while (elapsed < BENCH_SECONDS);
+
+            double mbs = stream.size() * (double)iterations / elapsed / 1e6;
+            if (!scalar_mbs) {
+                scalar_mbs = mbs;
+            }
+            printf("  %-8s %8.0f MB/s  %5.1fx\n", impl.name, mbs, mbs / scalar_mbs);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,295 @@
+// Producer/reader test for the shared memory frame ring: handshake,
+// read-only mapping, wake-ups, slot sequence numbers and overwrite
+// detection, plus a concurrent run with a reader slower than the producer.
+
+#include <pthread.h>
+#include "shm_ring_ctx.h"
+
+#define TEST_SLOTS 3
+#define TEST_FRAME_SIZE (64 * 1024)
+#define TEST_STRESS_FRAMES 3000
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static char ring_path[64];
+static uint8_t frame_buf[TEST_FRAME_SIZE];
+static uint8_t read_buf[TEST_FRAME_SIZE];
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Every frame is filled with its sequence number, so a torn copy shows.
+static uint64_t write_frame(shm_ring_ctx_t *ctx)
+{
+    uint64_t seq = atomic_load(&ctx->hdr->write_seq) + 1;
+
+    memset(frame_buf, (uint8_t)seq, sizeof(frame_buf));
+    shm_ring_frame_t info = {
+        .timestamp_us = seq * 10,
+        .fourcc = 0x56595559, // YUYV
+        .width = 128,
+        .height = 256,
+        .stride = 256,
+        .size = sizeof(frame_buf),
+    };
+    shm_ring_write(ctx, frame_buf, &info);
+    return seq;
+}
+
+static bool frame_intact(const uint8_t *data, ssize_t size, const shm_ring_frame_t *frame)
+{
+    if (frame->timestamp_us != frame->seq * 10) {
+        return false;
+    }
+    for (ssize_t i = 0; i < size; i++) {
+        if (data[i] != (uint8_t)frame->seq) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *open_reader_thread(void *arg)
+{
+    shm_ring_reader_t *r = arg;
+    if (shm_ring_reader_open(r, ring_path) < 0) {
+        r->map = NULL;
+    }
+    return NULL;
+}
+
+// shm_ring_reader_open() blocks until the producer accepts it.
+static int connect_reader(shm_ring_ctx_t *ctx, shm_ring_reader_t *r)
+{
+    pthread_t thread;
+    int clients = ctx->num_clients;
+
+    pthread_create(&thread, NULL, open_reader_thread, r);
+    for (int n = 0; n < 1000 && ctx->num_clients == clients; n++) {
+        shm_ring_accept_clients(ctx);
+        usleep(1000);
+    }
+    pthread_join(thread, NULL);
+    return r->map ? 0 : -1;
+}
+
+static void test_read_only(shm_ring_ctx_t *ctx, shm_ring_reader_t *r)
+{
+    CHECK(mprotect(r->map, r->map_size, PROT_READ | PROT_WRITE) < 0);
+
+    // Before Linux 5.1 the ring is only sealed against resizing.
+    if (!(fcntl(ctx->memfd, F_GET_SEALS) & F_SEAL_FUTURE_WRITE)) {
+        return;
+    }
+
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", ctx->memfd);
+    int fd = open(fd_path, O_RDWR);
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        void *map = mmap(NULL, ctx->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        CHECK(map == MAP_FAILED);
+        if (map != MAP_FAILED) {
+            munmap(map, ctx->map_size);
+        }
+        CHECK(write(fd, "x", 1) < 0);
+        close(fd);
+    }
+}
+
+static void test_sequence(shm_ring_ctx_t *ctx, shm_ring_reader_t *r)
+{
+    shm_ring_frame_t frame;
+
+    CHECK(shm_ring_reader_read(r, read_buf, sizeof(read_buf), &frame) == 0);
+
+    uint64_t seq = write_frame(ctx);
+    CHECK(shm_ring_reader_read(r, read_buf, sizeof(read_buf), &frame) == TEST_FRAME_SIZE);
+    CHECK(frame.seq == seq);
+    CHECK(frame.dropped == 0);
+    CHECK(frame.fourcc == 0x56595559 && frame.width == 128 && frame.height == 256 && frame.stride == 256);
+    CHECK(frame_intact(read_buf, TEST_FRAME_SIZE, &frame));
+    CHECK(shm_ring_reader_read(r, read_buf, sizeof(read_buf), &frame) == 0);
+
+    CHECK(shm_ring_reader_read(r, read_buf, 16, &frame) == 0);
+    write_frame(ctx);
+    CHECK(shm_ring_reader_read(r, read_buf, 16, &frame) == -1);
+    CHECK(shm_ring_reader_read(r, read_buf, sizeof(read_buf), &frame) == TEST_FRAME_SIZE);
+    CHECK(frame.seq == seq + 1);
+}
+
+// A reader that falls more than a ring behind gets the newest frame and the
+// number of frames it missed.
+static void test_overwrite(shm_ring_ctx_t *ctx, shm_ring_reader_t *r)
+{
+    shm_ring_frame_t frame;
+    uint64_t seq = 0;
+
+    for (int n = 0; n < TEST_SLOTS * 2 + 1; n++) {
+        seq = write_frame(ctx);
+    }
+
+    CHECK(shm_ring_reader_read(r, read_buf, sizeof(read_buf), &frame) == TEST_FRAME_SIZE);
+    CHECK(frame.seq == seq);
+    CHECK(frame.dropped == TEST_SLOTS * 2);
+    CHECK(frame_intact(read_buf, TEST_FRAME_SIZE, &frame));
+
+    // Each slot carries the sequence number of the frame now in it.
+    for (int n = 0; n < TEST_SLOTS; n++) {
+        CHECK(atomic_load(&shm_ring_slot(ctx->hdr, seq - n)->seq) == seq - n);
+    }
+    CHECK(shm_ring_reader_read(r, read_buf, sizeof(read_buf), &frame) == 0);
+}
+
+typedef struct {
+    shm_ring_reader_t *r;
+    int timeout_ms;
+    int ret;
+    uint64_t elapsed_ms;
+} wait_args_t;
+
+static void *wait_thread(void *arg)
+{
+    wait_args_t *args = arg;
+    uint64_t start = now_ms();
+    args->ret = shm_ring_reader_wait(args->r, args->timeout_ms);
+    args->elapsed_ms = now_ms() - start;
+    return NULL;
+}
+
+static void test_wakeup(shm_ring_ctx_t *ctx, shm_ring_reader_t *r)
+{
+    shm_ring_frame_t frame;
+    uint64_t start = now_ms();
+
+    CHECK(shm_ring_reader_wait(r, 50) == 0);
+    CHECK(now_ms() - start >= 40);
+
+    wait_args_t args = { r, 5000, -1, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, wait_thread, &args);
+    usleep(20000);
+    write_frame(ctx);
+    pthread_join(thread, NULL);
+    CHECK(args.ret == 1);
+    CHECK(args.elapsed_ms < 1000);
+
+    // Already there: no wait at all.
+    CHECK(shm_ring_reader_wait(r, 5000) == 1);
+    CHECK(shm_ring_reader_read(r, read_buf, sizeof(read_buf), &frame) == TEST_FRAME_SIZE);
+}
+
+typedef struct {
+    shm_ring_reader_t *r;
+    atomic_bool done;
+    uint64_t first_seq;
+    uint64_t got;
+    uint64_t dropped;
+    uint64_t bad;
+    uint64_t last_seq;
+} stress_args_t;
+
+static void *stress_reader(void *arg)
+{
+    stress_args_t *args = arg;
+    static uint8_t buf[TEST_FRAME_SIZE];
+    shm_ring_frame_t frame;
+    uint64_t prev = args->first_seq;
+
+    while (!atomic_load(&args->done) || args->r->last_seq < args->r->hdr->write_seq) {
+        if (shm_ring_reader_wait(args->r, 100) <= 0) {
+            continue;
+        }
+        ssize_t size = shm_ring_reader_read(args->r, buf, sizeof(buf), &frame);
+        if (size <= 0) {
+            continue;
+        }
+        if (frame.seq <= prev || frame.dropped != frame.seq - prev - 1 || !frame_intact(buf, size, &frame)) {
+            args->bad++;
+        }
+        prev = frame.seq;
+        args->got++;
+        args->dropped += frame.dropped;
+        if (args->got % 3 == 0) {
+            usleep(1000);
+        }
+    }
+    args->last_seq = prev;
+    return NULL;
+}
+
+static void test_stress(shm_ring_ctx_t *ctx, shm_ring_reader_t *r)
+{
+    stress_args_t args = { .r = r, .first_seq = r->last_seq };
+    uint64_t seq = atomic_load(&ctx->hdr->write_seq);
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, stress_reader, &args);
+    for (int n = 1; n <= TEST_STRESS_FRAMES; n++) {
+        write_frame(ctx);
+        if (n % 100 == 0) {
+            usleep(1000);
+        }
+    }
+    atomic_store(&args.done, true);
+    pthread_join(thread, NULL);
+
+    printf("stress: %d frames written, %llu read, %llu overwritten\n", TEST_STRESS_FRAMES,
+           (unsigned long long)args.got, (unsigned long long)args.dropped);
+    CHECK(args.bad == 0);
+    CHECK(args.got > 0);
+    CHECK(args.last_seq == seq + TEST_STRESS_FRAMES);
+    CHECK(args.got + args.dropped == TEST_STRESS_FRAMES);
+}
+
+int main(void)
+{
+    shm_ring_ctx_t ctx = DEFAULT_SHM_RING_CTX;
+    shm_ring_reader_t r = DEFAULT_SHM_RING_READER;
+
+    snprintf(ring_path, sizeof(ring_path), "/tmp/shm_ring_test.%d", (int)getpid());
+
+    if (shm_ring_open(&ctx, ring_path, TEST_SLOTS, TEST_FRAME_SIZE) < 0) {
+        fprintf(stderr, "shm_ring_open failed\n");
+        return 1;
+    }
+    if (connect_reader(&ctx, &r) < 0) {
+        fprintf(stderr, "shm_ring_reader_open failed\n");
+        shm_ring_close(&ctx);
+        return 1;
+    }
+    CHECK(ctx.num_clients == 1);
+    CHECK(r.hdr->num_slots == TEST_SLOTS);
+
+    test_read_only(&ctx, &r);
+    test_sequence(&ctx, &r);
+    test_overwrite(&ctx, &r);
+    test_wakeup(&ctx, &r);
+    test_stress(&ctx, &r);
+
+    shm_ring_reader_close(&r);
+    for (int n = 0; n < 1000 && ctx.num_clients > 0; n++) {
+        shm_ring_accept_clients(&ctx);
+        usleep(1000);
+    }
+    CHECK(ctx.num_clients == 0);
+    shm_ring_close(&ctx);
+
+    if (failures) {
+        fprintf(stderr, "shm_ring_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("shm_ring_test: ok\n");
+    return 0;
+}
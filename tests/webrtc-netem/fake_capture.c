@@ -0,0 +1,148 @@
+// Stand-in for capture-v4l2-raw-mpp's H264 socket: serves synthetic H264 at
+// `kbps`, capped by the SOCK_MSG_BITRATE requests of its clients exactly as
+// mpp_encoder_set_bitrate() caps the real encoder, and honours keyframe
+// requests. The slices are random bytes, so the stream only makes sense to
+// packetizers, not to decoders. Prints the cap and the bitrate sent every
+// second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sock_ctx.h"
+
+#define GOP_FRAMES 60
+#define MIN_BITRATE 100
+#define KEYFRAME_SCALE 4
+
+static volatile sig_atomic_t running = 1;
+
+static void signal_handler(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static size_t append(uint8_t *buf, size_t len, const uint8_t *data, size_t size)
+{
+    memcpy(buf + len, data, size);
+    return len + size;
+}
+
+// Random payload with emulation prevention, so the only start codes are
+// the real ones.
+static size_t append_slice(uint8_t *buf, size_t len, uint8_t nal_type, size_t size)
+{
+    const uint8_t hdr[] = { 0, 0, 0, 1, nal_type, 0x88 };
+    int zeros = 0;
+
+    len = append(buf, len, hdr, sizeof(hdr));
+    for (size_t n = 0; n < size; n++) {
+        uint8_t b = rand();
+        if (zeros >= 2 && b <= 3) {
+            buf[len++] = 3;
+            zeros = 0;
+        }
+        buf[len++] = b;
+        zeros = b == 0 ? zeros + 1 : 0;
+    }
+    return len;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint8_t sps[] = { 0, 0, 0, 1, 0x67, 0x42, 0xc0, 0x1f, 0x8c, 0x8d, 0x40, 0x50, 0x1e, 0xd0, 0x0f, 0x08, 0x84, 0x6a };
+    static const uint8_t pps[] = { 0, 0, 0, 1, 0x68, 0xce, 0x3c, 0x80 };
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <h264-sock> [kbps] [fps]\n", argv[0]);
+        return 1;
+    }
+    unsigned int kbps = argc > 2 ? atoi(argv[2]) : 4000;
+    unsigned int fps = argc > 3 ? atoi(argv[3]) : 30;
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    sock_ctx_t sock = DEFAULT_SOCK_CTX;
+    sock.codec = SOCK_CODEC_H264;
+    sock.gop_cache = true;
+    if (sock_open(&sock, argv[1]) < 0) {
+        return 1;
+    }
+
+    // Keyframes are KEYFRAME_SCALE times a P frame; the average stays at
+    // the target.
+    size_t max_frame = (size_t)kbps * 1000 / 8 / fps * KEYFRAME_SCALE * 2 + 1024;
+    uint8_t *frame = malloc(max_frame);
+    unsigned int cap = 0;
+    uint64_t frame_us = 1000000 / fps;
+    uint64_t next = now_us(), stats_time = next, bytes = 0;
+
+    for (uint64_t n = 0; running; n++) {
+        sock_accept_clients(&sock);
+
+        unsigned int target = sock.bitrate_kbps && sock.bitrate_kbps < kbps ? sock.bitrate_kbps : kbps;
+        if (target < MIN_BITRATE) {
+            target = MIN_BITRATE;
+        }
+        if (target != cap) {
+            printf("cap %u kbps\n", target);
+            fflush(stdout);
+            cap = target;
+        }
+
+        bool keyframe = atomic_exchange(&sock.need_keyframe, false) || n % GOP_FRAMES == 0;
+
+        size_t p_size = (size_t)target * 1000 / 8 * GOP_FRAMES / fps / (GOP_FRAMES - 1 + KEYFRAME_SCALE);
+        size_t len = 0;
+        if (keyframe) {
+            len = append(frame, len, sps, sizeof(sps));
+            len = append(frame, len, pps, sizeof(pps));
+            len = append_slice(frame, len, 0x65, p_size * KEYFRAME_SCALE);
+        } else {
+            len = append_slice(frame, len, 0x41, p_size);
+        }
+
+        if (sock.num_clients > 0) {
+            frame_meta_t meta = {
+                .timestamp_us = now_us(),
+                .flags = keyframe ? SOCK_FRAME_KEYFRAME | SOCK_FRAME_PARAM_SETS : 0,
+            };
+            sock_write_cb(frame, len, &meta, &sock);
+            bytes += len;
+        }
+
+        uint64_t now = now_us();
+        if (now - stats_time >= 1000000) {
+            printf("sent %llu kbps, clients %d\n", (unsigned long long)(bytes * 8 * 1000 / (now - stats_time)),
+                   (int)sock.num_clients);
+            fflush(stdout);
+            bytes = 0;
+            stats_time = now;
+        }
+
+        next += frame_us;
+        if (next > now) {
+            usleep(next - now);
+        }
+    }
+
+    sock_close(&sock);
+    free(frame);
+    return 0;
+}
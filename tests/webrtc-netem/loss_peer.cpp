@@ -0,0 +1,202 @@
+// Loopback WebRTC viewer for stream-webrtc. Negotiates over the signaling
+// socket like webrtc.html, answers the keepalive pings, counts the RTP it
+// receives and runs a loss-based estimate (the loss half of Google
+// congestion control): more than 10% loss backs off, less than 2% probes
+// 8% higher, never far above what actually arrives. The estimate goes back
+// as REMB every second, which stream-webrtc turns into the encoder cap.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <rtc/rtc.hpp>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+static constexpr double HIGH_LOSS = 0.10;
+static constexpr double LOW_LOSS = 0.02;
+static constexpr double PROBE_GAIN = 1.08;
+static constexpr double MAX_OVER_RECEIVED = 1.5;
+static constexpr unsigned MIN_ESTIMATE_KBPS = 100;
+
+// One request per connection, one JSON line back.
+static json signaling_request(const std::string &path, const json &request) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    std::string line = request.dump() + "\n";
+    if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+        perror("write");
+        exit(1);
+    }
+
+    std::string response;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        response.append(buf, n);
+    }
+    close(fd);
+    return json::parse(response);
+}
+
+struct Stats {
+    std::mutex lock;
+    bool started = false;
+    uint64_t highest = 0; // extended sequence number
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+};
+
+static void count_rtp(Stats &stats, const rtc::binary &pkt) {
+    if (pkt.size() < 12) {
+        return;
+    }
+    uint16_t seq = (std::to_integer<uint16_t>(pkt[2]) << 8) | std::to_integer<uint16_t>(pkt[3]);
+
+    std::lock_guard<std::mutex> lk(stats.lock);
+    if (!stats.started) {
+        stats.highest = seq;
+        stats.started = true;
+    } else {
+        int16_t delta = (int16_t)(seq - (uint16_t)stats.highest);
+        if (delta > 0) {
+            stats.highest += delta;
+        }
+    }
+    stats.packets++;
+    stats.bytes += pkt.size();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <webrtc-sock> [seconds] [start-kbps]\n", argv[0]);
+        return 1;
+    }
+    std::string sock = argv[1];
+    int seconds = argc > 2 ? atoi(argv[2]) : 30;
+    double estimate = argc > 3 ? atoi(argv[3]) : 4000;
+
+    rtc::InitLogger(rtc::LogLevel::Warning);
+
+    json offer = signaling_request(sock, {{"type", "request"}, {"keepAlive", true}, {"timeout_s", seconds + 10}});
+    if (!offer.contains("sdp")) {
+        fprintf(stderr, "request failed: %s\n", offer.dump().c_str());
+        return 1;
+    }
+
+    auto pc = std::make_shared<rtc::PeerConnection>(rtc::Configuration());
+    Stats stats;
+    std::shared_ptr<rtc::Track> track;
+    std::shared_ptr<rtc::DataChannel> keepalive;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool gathered = false;
+
+    pc->onTrack([&](std::shared_ptr<rtc::Track> t) {
+        t->setMediaHandler(std::make_shared<rtc::RtcpReceivingSession>());
+        t->onMessage([&stats](rtc::binary pkt) { count_rtp(stats, pkt); }, nullptr);
+        std::lock_guard<std::mutex> lk(lock);
+        track = t;
+    });
+    pc->onDataChannel([&](std::shared_ptr<rtc::DataChannel> dc) {
+        std::weak_ptr<rtc::DataChannel> weak_dc = dc;
+        dc->onMessage([weak_dc](rtc::message_variant) {
+            if (auto c = weak_dc.lock()) {
+                c->send(std::string("pong"));
+            }
+        });
+        std::lock_guard<std::mutex> lk(lock);
+        keepalive = dc;
+    });
+    pc->onGatheringStateChange([&](rtc::PeerConnection::GatheringState state) {
+        if (state == rtc::PeerConnection::GatheringState::Complete) {
+            std::lock_guard<std::mutex> lk(lock);
+            gathered = true;
+            cond.notify_all();
+        }
+    });
+
+    // The answer carries all our candidates, so no trickle is needed.
+    pc->setRemoteDescription(rtc::Description(offer["sdp"].get<std::string>(), rtc::Description::Type::Offer));
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        cond.wait(lk, [&] { return gathered; });
+    }
+    auto answer = pc->localDescription();
+    json ok = signaling_request(sock, {{"type", "answer"}, {"id", offer["id"]}, {"sdp", std::string(*answer)}});
+    if (ok.contains("error")) {
+        fprintf(stderr, "answer failed: %s\n", ok.dump().c_str());
+        return 1;
+    }
+
+    uint64_t last_highest = 0, last_packets = 0, last_bytes = 0;
+    bool have_last = false;
+
+    for (int t = 1; t <= seconds; t++) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        uint64_t highest, packets, bytes;
+        {
+            std::lock_guard<std::mutex> lk(stats.lock);
+            highest = stats.highest;
+            packets = stats.packets;
+            bytes = stats.bytes;
+        }
+
+        unsigned received_kbps = (bytes - last_bytes) * 8 / 1000;
+        double loss = 0;
+        if (have_last && highest > last_highest) {
+            double expected = highest - last_highest;
+            loss = 1.0 - (packets - last_packets) / expected;
+            loss = loss < 0 ? 0 : loss;
+        }
+
+        if (loss > HIGH_LOSS) {
+            estimate *= 1.0 - 0.5 * loss;
+        } else if (loss < LOW_LOSS) {
+            estimate *= PROBE_GAIN;
+        }
+        if (received_kbps && estimate > received_kbps * MAX_OVER_RECEIVED) {
+            estimate = received_kbps * MAX_OVER_RECEIVED;
+        }
+        if (estimate < MIN_ESTIMATE_KBPS) {
+            estimate = MIN_ESTIMATE_KBPS;
+        }
+
+        std::shared_ptr<rtc::Track> video;
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            video = track;
+        }
+        if (video && video->isOpen()) {
+            video->requestBitrate((unsigned)estimate * 1000);
+        }
+
+        printf("t=%3ds received %5u kbps  loss %5.1f%%  remb %5u kbps\n", t, received_kbps, loss * 100, (unsigned)estimate);
+        fflush(stdout);
+
+        last_highest = highest;
+        last_packets = packets;
+        last_bytes = bytes;
+        have_last = packets > 0;
+    }
+
+    pc->close();
+    return 0;
+}
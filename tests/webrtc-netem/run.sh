@@ -0,0 +1,44 @@
+#!/bin/bash
+# Bitrate adaptation under packet loss, all on this machine: fake_capture
+# feeds stream-webrtc, loss_peer receives and answers with REMB, and netem
+# drops packets on lo in phases of PHASE_S seconds. Watch the encoder cap
+# follow the loss. Needs root for tc and affects all loopback traffic while
+# it runs. Build with `make` here and `make stream-webrtc` at the top.
+#
+#   sudo tests/webrtc-netem/run.sh [loss% ...]    (default: 0 20 5 0)
+
+set -eo pipefail
+
+DIR=$(realpath "$(dirname "$0")")
+STREAM_WEBRTC=${STREAM_WEBRTC:-$DIR/../../apps/stream-webrtc/stream-webrtc}
+KBPS=${KBPS:-4000}
+PHASE_S=${PHASE_S:-15}
+PHASES=("$@")
+if [[ ${#PHASES[@]} -eq 0 ]]; then
+    PHASES=(0 20 5 0)
+fi
+
+TMP=$(mktemp -d)
+cleanup() {
+    tc qdisc del dev lo root 2>/dev/null || true
+    kill $(jobs -p) 2>/dev/null || true
+    wait 2>/dev/null || true
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+"$DIR/fake_capture" "$TMP/h264.sock" "$KBPS" | sed -u -n 's/^cap /capture: cap /p' &
+sleep 0.5
+"$STREAM_WEBRTC" --h264-sock "$TMP/h264.sock" --webrtc-sock "$TMP/webrtc.sock" > "$TMP/webrtc.log" 2>&1 &
+sleep 0.5
+
+"$DIR/loss_peer" "$TMP/webrtc.sock" $((PHASE_S * ${#PHASES[@]})) "$KBPS" | sed -u 's/^/peer: /' &
+PEER=$!
+
+for loss in "${PHASES[@]}"; do
+    echo "== ${loss}% loss"
+    tc qdisc replace dev lo root netem loss "${loss}%"
+    sleep "$PHASE_S"
+done
+
+wait $PEER